@@ -42,12 +42,69 @@
     20181115 : unroll small FILL blocks (threshold in CUSTOMIZE_SMALLEST_FILL_BLOCK)
     20181119 : workaround for CCES-17764 (elfloader.exe hard-codes entry address)
     20190521 : bug fix for when input LDR creates overlapping blocks in memory
+    20261016 : optional batching of large FILL blocks into a single INIT stub (--fill-stub)
+    20261016 : boot timing model (--profile) and hoisting of clock/PLL/DDR "speed-up" INIT blocks (--hook)
+    20261016 : declared INIT footprints (--init-range) let blocks merge across INIT blocks
+    20261016 : two-stage boot: everything after a chosen INIT block goes to a stage-2 payload (--split, --stage2)
+    20261016 : fast-loader stub that reconfigures the boot flash and loads stage 2 itself (--fast-loader)
+    20261016 : per-family memory maps (--family, --memory-map); no merging across regions, MMR writes are barriers
+    20261016 : per-family backends (loader format plus memory map), adding BF54x and BF51x
+    20261016 : legacy BF53x loader format (--family=bf53x)
+    20261016 : ASCII, include-file and Intel hex input/output, and C array output (--input-format, --output-format)
+    20261016 : host-driven (slave) boot: handshake latency in the model and a host-side transfer table (--host-table)
+    20261016 : gap bridging (--bridge) and size-constrained choice of FILL unrolling and bridging (--max-size, --pareto)
+    20261016 : alignment of payloads and block headers to DMA and flash granules, when the model says it pays (--page-size, --stream-align, --dest-align)
+    20261016 : sparse memory image export (--export-memory) and synthesis of a loader file from one (--input-format=memory)
+    20261016 : attribution of boot time to the sections and symbols of the ELF (--elf)
+    20261016 : linker layout advice on the gaps between sections that cost block headers (--advise, --linker-map)
+    20261016 : verbosity levels (--quiet, --verbose) and JSON or CSV statistics (--report)
+    20261016 : Chrome trace of the tool's own phases, with peak memory and allocation counts (--trace)
+    20261016 : Chrome trace of the modelled boot of the input and output images, block by block (--timeline)
+    20261016 : calibration of the timing model from measured boot times (--calibrate)
+    20261016 : measured boot time per block from a logic analyzer capture of SPI or UART (--capture)
+    20261016 : multi-threaded scan of raw flash dumps for loader streams, listing or extracting each (--scan, --extract)
+    20261016 : in-place optimization of a loader stream embedded in a flash image (--flash-offset, --erase-value)
+    20261016 : layout that keeps unchanged blocks where a previous image had them, to touch fewer sectors in an update (--reference, --sector-size)
+    20261016 : comparison of two loader images, memory and blocks and flash sectors (--diff)
+    20261016 : content-addressed cache of output images for build systems (--cache-dir)
 */
 
 #include <stdio.h>
 #include <malloc.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <math.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#else
+#include <process.h>
+#include <direct.h>
+#define getpid _getpid
+#define mkdir(path, mode) _mkdir(path)
+#endif
+#include <errno.h>
+
+/*
+every allocation is counted, for the statistics and --trace
+*/
+static unsigned allocation_count;
+
+static void *count_allocation(void *pointer)
+{
+	allocation_count++;
+	return pointer;
+}
+
+#define malloc(size)           count_allocation(malloc(size))
+#define calloc(count, size)    count_allocation(calloc(count, size))
+#define realloc(pointer, size) count_allocation(realloc(pointer, size))
 
 /*
 abbreviated and combined information from ADSP-SC58x and ADSP-BF70x Hardware Reference Manuals
@@ -57,6 +114,19 @@ abbreviated and combined information from ADSP-SC58x and ADSP-BF70x Hardware Ref
 #define BFLAG_IGNORE    0x100 /* Block payload is ignored. */
 #define BFLAG_FIRST     0x400 /* Indicates the block to be the beginning of a new application */
 #define BFLAG_FINAL     0x800 /* Indicates the last block of a loader stream. Booting will complete after processing the block. This flag does not denote the end of an application in a Multi-Application Boot Streams boot stream */
+#define BLOCK_HDRSIGN   0xAD  /* signature byte of every block header */
+
+/*
+abbreviated information from the ADSP-BF533 and ADSP-BF537 Hardware Reference Manuals; the 10-byte header is address, count, flag
+*/
+#define LFLAG_ZEROFILL  0x0001 /* Fill the target location with zeros; there is no payload */
+#define LFLAG_RESVECT   0x0002 /* Resume vector (0xFFA00000 when set, 0xFFA08000 when clear) */
+#define LFLAG_INIT      0x0008 /* Calls function at target address after loading payload */
+#define LFLAG_IGNORE    0x0010 /* Block payload is ignored */
+#define LFLAG_PFLAG     0x01E0 /* Programmable flag used as the host wait strobe */
+#define LFLAG_PPORT     0x0600 /* Port of the programmable flag */
+#define LFLAG_FINAL     0x8000 /* Indicates the last block; booting will complete after loading its payload */
+#define LEGACY_HEADER_SIZE 10
 
 struct block_header_type
 {
@@ -79,332 +149,6479 @@ struct chunk_list_type
 	unsigned char *data;
 	unsigned length;
 	unsigned flags;
+	unsigned mark; /* scratch field for the optimization passes */
 	struct chunk_list_type *next;
 };
 
+/*
+each segment is the list of chunks between INIT blocks; a segment that is terminated by an INIT block has it as its last chunk
+*/
+struct segment_list_type
+{
+	struct chunk_list_type *chunks;
+	struct segment_list_type *next;
+};
+
+struct buffer_type
+{
+	unsigned char *data;
+	unsigned length, allocated;
+};
+
+/*
+sparse memory image: the contents of memory once every block has been loaded, as a list of extents in address order that
+neither overlap nor touch
+*/
+struct extent_type
+{
+	unsigned address, length;
+	unsigned char *data;
+	struct extent_type *next;
+};
+
+/*
+simple model of the Boot ROM; times are in microseconds and per-byte costs in nanoseconds
+*/
+struct cost_model_type
+{
+	double header_us; /* overhead of fetching and dispatching one block header */
+	double byte_ns;   /* transferring one payload byte from the boot source */
+	double fill_ns;   /* filling one byte of memory */
+	double init_us;   /* calling an INIT routine (excluding the routine itself) */
+	double fastload_speedup; /* throughput of the fast-loader stub relative to the Boot ROM */
+	double handshake_us;     /* slave boot: host waiting for HWAIT/ready before each block */
+	double host_transfer_us; /* slave boot: host overhead of starting each DMA transfer */
+	double host_dma_max;     /* slave boot: largest DMA transfer the host can push in one go */
+	double page_cross_us;    /* a block header that straddles a flash page (see --page-size) */
+	double unaligned_us;     /* a payload whose stream offset or destination is not aligned (see --stream-align, --dest-align) */
+};
+
+/*
+per-board settings handed to the fast-loader stub for reconfiguring the boot flash
+*/
+struct board_type
+{
+	double flash_lanes;        /* 1, 2, 4 or 8 */
+	double flash_clock_div;
+	double flash_read_command;
+	double flash_dummy_cycles;
+};
+
+#define MAX_HOOKS 16
+#define MAX_FOOTPRINTS 16
+#define MAX_FOOTPRINT_RANGES 8
+
+/*
+the memory that an INIT routine (identified by its target address) reads, writes or executes
+*/
+struct footprint_type
+{
+	unsigned address;
+	unsigned range_count;
+	struct { unsigned address, length; } ranges[MAX_FOOTPRINT_RANGES];
+};
+
+/*
+a "speed-up" hook is an INIT block that raises the boot throughput, e.g. CGU/PLL or DDR set-up
+*/
+struct hook_type
+{
+	struct footprint_type footprint;
+	double speedup;
+};
+
+enum region_kind { REGION_L1, REGION_L2, REGION_DDR, REGION_MMR, REGION_FLASH, REGION_OTHER };
+
+struct region_type
+{
+	unsigned start, end; /* inclusive */
+	const char *name;
+	enum region_kind kind;
+	double write_ns;     /* added to the per-byte cost of writing into this region */
+};
+
+/*
+abbreviated memory maps from the ADSP-SC58x, ADSP-SC57x and ADSP-BF70x Hardware Reference Manuals
+*/
+static const struct region_type sc58x_regions[] =
+{
+	{ 0x00240000, 0x0039FFFF, "L1",        REGION_L1,    0.0 },
+	{ 0x20000000, 0x200FFFFF, "L2",        REGION_L2,    0.5 },
+	{ 0x28240000, 0x2839FFFF, "L1 core1",  REGION_L1,    0.0 },
+	{ 0x28A40000, 0x28B9FFFF, "L1 core2",  REGION_L1,    0.0 },
+	{ 0x30000000, 0x3FFFFFFF, "MMR",       REGION_MMR,   0.0 },
+	{ 0x60000000, 0x7FFFFFFF, "SPI flash", REGION_FLASH, 0.0 },
+	{ 0x80000000, 0xBFFFFFFF, "DDR0",      REGION_DDR,   2.0 },
+	{ 0xC0000000, 0xDFFFFFFF, "DDR1",      REGION_DDR,   2.0 },
+};
+
+static const struct region_type sc57x_regions[] =
+{
+	{ 0x00240000, 0x0039FFFF, "L1",        REGION_L1,    0.0 },
+	{ 0x20000000, 0x200FFFFF, "L2",        REGION_L2,    0.5 },
+	{ 0x28240000, 0x2839FFFF, "L1 core1",  REGION_L1,    0.0 },
+	{ 0x28A40000, 0x28B9FFFF, "L1 core2",  REGION_L1,    0.0 },
+	{ 0x30000000, 0x3FFFFFFF, "MMR",       REGION_MMR,   0.0 },
+	{ 0x60000000, 0x7FFFFFFF, "SPI flash", REGION_FLASH, 0.0 },
+	{ 0x80000000, 0xBFFFFFFF, "DDR",       REGION_DDR,   2.0 },
+};
+
+static const struct region_type bf70x_regions[] =
+{
+	{ 0x08000000, 0x080FFFFF, "L2",        REGION_L2,    0.5 },
+	{ 0x11800000, 0x11BFFFFF, "L1",        REGION_L1,    0.0 },
+	{ 0x20000000, 0x3FFFFFFF, "SMMR",      REGION_MMR,   0.0 },
+	{ 0x40000000, 0x4FFFFFFF, "SPI flash", REGION_FLASH, 0.0 },
+	{ 0x80000000, 0x9FFFFFFF, "DDR",       REGION_DDR,   2.0 },
+	{ 0xFF800000, 0xFFBFFFFF, "L1 local",  REGION_L1,    0.0 },
+	{ 0xFFE00000, 0xFFFFFFFF, "CMMR",      REGION_MMR,   0.0 },
+};
+
+/*
+abbreviated memory maps from the ADSP-BF54x and ADSP-BF51x Hardware Reference Manuals
+*/
+static const struct region_type bf54x_regions[] =
+{
+	{ 0x00000000, 0x1FFFFFFF, "DDR",       REGION_DDR,   2.0 },
+	{ 0x20000000, 0x2FFFFFFF, "async",     REGION_OTHER, 4.0 },
+	{ 0xFEB00000, 0xFEB1FFFF, "L2",        REGION_L2,    0.5 },
+	{ 0xFF800000, 0xFFBFFFFF, "L1",        REGION_L1,    0.0 },
+	{ 0xFFC00000, 0xFFDFFFFF, "SMMR",      REGION_MMR,   0.0 },
+	{ 0xFFE00000, 0xFFFFFFFF, "CMMR",      REGION_MMR,   0.0 },
+};
+
+/*
+abbreviated memory map from the ADSP-BF533 and ADSP-BF537 Hardware Reference Manuals
+*/
+static const struct region_type bf53x_regions[] =
+{
+	{ 0x00000000, 0x07FFFFFF, "SDRAM",     REGION_DDR,   2.0 },
+	{ 0x20000000, 0x203FFFFF, "async",     REGION_OTHER, 4.0 },
+	{ 0xFF800000, 0xFFBFFFFF, "L1",        REGION_L1,    0.0 },
+	{ 0xFFC00000, 0xFFDFFFFF, "SMMR",      REGION_MMR,   0.0 },
+	{ 0xFFE00000, 0xFFFFFFFF, "CMMR",      REGION_MMR,   0.0 },
+};
+
+static const struct region_type bf51x_regions[] =
+{
+	{ 0x00000000, 0x07FFFFFF, "SDRAM",     REGION_DDR,   2.0 },
+	{ 0x20000000, 0x2FFFFFFF, "async",     REGION_OTHER, 4.0 },
+	{ 0xFF800000, 0xFFBFFFFF, "L1",        REGION_L1,    0.0 },
+	{ 0xFFC00000, 0xFFDFFFFF, "SMMR",      REGION_MMR,   0.0 },
+	{ 0xFFE00000, 0xFFFFFFFF, "CMMR",      REGION_MMR,   0.0 },
+};
+
+/*
+a loader stream format: how headers are read (into the block_header_type representation used throughout) and written
+*/
+struct format_type
+{
+	unsigned header_size;
+	int first_block;       /* whether each application starts with a First Block */
+	int final_has_payload; /* whether the Final Block is an ordinary block that also ends the stream */
+	int (*read_header)(const unsigned char *data, struct block_header_type *hdr); /* non-zero if the header is invalid */
+	void (*write_header)(struct buffer_type *handle, struct block_header_type *hdr);
+	void (*write_final)(struct buffer_type *handle, struct block_header_type *hdr);
+};
+
+static int read_header_v2(const unsigned char *data, struct block_header_type *hdr);
+static void write_header_v2(struct buffer_type *handle, struct block_header_type *hdr);
+static int read_header_legacy(const unsigned char *data, struct block_header_type *hdr);
+static void write_header_legacy(struct buffer_type *handle, struct block_header_type *hdr);
+static void write_final_legacy(struct buffer_type *handle, struct block_header_type *hdr);
+
+/* ADSP-SC58x, ADSP-SC57x, ADSP-BF70x and ADSP-BF54x/BF51x share the same 16-byte block header */
+static const struct format_type v2_format = { sizeof(struct block_header_type), 1, 0, read_header_v2, write_header_v2, write_header_v2 };
+
+/* ADSP-BF531/2/3/4/6/7 and ADSP-BF538/9 use a 10-byte header without a checksum, and have no First Block */
+static const struct format_type legacy_format = { LEGACY_HEADER_SIZE, 0, 1, read_header_legacy, write_header_legacy, write_final_legacy };
+
+/*
+each processor family is a backend: its loader stream format and its memory map
+*/
+struct family_type
+{
+	const char *name;
+	const struct format_type *format;
+	const struct region_type *regions;
+	unsigned region_count;
+};
+
+#define REGIONS(x) x, sizeof(x) / sizeof(x[0])
+
+static const struct family_type family_table[] =
+{
+	{ "sc58x", &v2_format, REGIONS(sc58x_regions) },
+	{ "sc57x", &v2_format, REGIONS(sc57x_regions) },
+	{ "bf70x", &v2_format, REGIONS(bf70x_regions) },
+	{ "bf54x", &v2_format, REGIONS(bf54x_regions) },
+	{ "bf51x", &v2_format, REGIONS(bf51x_regions) },
+	{ "bf53x", &legacy_format, REGIONS(bf53x_regions) },
+};
+
+#define MAX_REGIONS 64
+
 struct image_settings_type
 {
 	unsigned char hdrsign, bcode;
 	unsigned entry_point;
 };
 
-static void write_header(FILE *handle, struct block_header_type *hdr);
+struct application_list_type
+{
+	struct image_settings_type settings;
+	struct segment_list_type *segments;
+	struct application_list_type *next;
+};
+
+/*
+a segment's chunks in address order, and which of the boundaries between neighbours are to be closed
+*/
+struct plan_type
+{
+	struct segment_list_type *segment;
+	unsigned count;
+	struct chunk_list_type **sorted;
+	unsigned char *join;     /* join[i] merges sorted[i] with sorted[i + 1] */
+	int batched;             /* the segment's FILL blocks will go into a --fill-stub table */
+	int staged;              /* the segment goes into the --stage2 file, so costs the image nothing */
+	struct plan_type *next;
+};
+
+/*
+a transformation that trades image size for boot time: closing boundaries first..last of a plan together
+*/
+struct candidate_type
+{
+	struct plan_type *plan;
+	unsigned first, last;
+	int unrolls_fill;
+	int delta_bytes;
+	double delta_us;
+};
+
+/*
+settings gathered from the "--name=value" command-line options
+*/
+struct option_settings_type
+{
+	const char *fill_stub_file;          /* user-supplied routine that performs the batched fills */
+	unsigned fill_stub_address;          /* where the routine is loaded and called (as an INIT block) */
+	unsigned fill_table_address;         /* where the fill descriptor table is loaded */
+	unsigned fill_batch_minimum;         /* fewest FILL blocks in a segment that justifies the stub */
+	unsigned char *fill_stub;
+	unsigned fill_stub_length;
+	const char *profile_file;            /* timing model parameters */
+	struct cost_model_type model;
+	unsigned hook_count;
+	struct hook_type hooks[MAX_HOOKS];
+	unsigned footprint_count;
+	struct footprint_type footprints[MAX_FOOTPRINTS];
+	const char *stage2_file;             /* destination of everything after the split point */
+	const char *split;                   /* --split as given (0 is a valid address, so its absence can't be) */
+	unsigned split_address;              /* target address of the INIT block that ends stage 1 */
+	const char *fast_loader_file;        /* user-supplied routine that reconfigures the boot flash and loads stage 2 */
+	unsigned fast_loader_address;        /* where the routine is loaded and called (as an INIT block) */
+	unsigned char *fast_loader;
+	unsigned fast_loader_length;
+	struct board_type board;
+	const char *family_name;
+	const struct format_type *format;    /* loader stream format of the selected family */
+	const char *memory_map_file;         /* overrides the family's built-in memory map */
+	const struct region_type *regions;   /* none means a flat address space */
+	unsigned region_count;
+	struct region_type loaded_regions[MAX_REGIONS];
+	const char *input_format;            /* auto, binary, ascii, include or ihex */
+	const char *output_format;           /* binary, ascii, include, ihex or carray */
+	unsigned ihex_base;                  /* address of the loader image in Intel hex output */
+	const char *host_table_file;         /* slave boot: table of transfers for the host driver */
+	unsigned smallest_fill_block;        /* FILL blocks up to this size are unrolled into neighbouring data */
+	unsigned bridge_max;                 /* largest unused gap between blocks that may be filled to merge them */
+	unsigned max_size;                   /* size budget of the output image; zero for none */
+	unsigned size_slack;                 /* what the size budget has left for alignment and reference padding */
+	unsigned pareto;                     /* print the size/boot-time trade-off curve */
+	unsigned page_size;                  /* flash page size; zero if headers may straddle pages at no cost */
+	unsigned stream_align;               /* granule for the stream offset of each payload */
+	unsigned dest_align;                 /* granule for the destination address and length of each payload */
+	const char *export_memory_prefix;    /* where the memory image is written as a map file and per-region binary files */
+	const char *elf_file;                /* ELF (.dxe) that the loader image was made from, for attributing boot time */
+	const char *linker_map_file;         /* GNU ld style map file of the same link */
+	unsigned advise;                     /* report the gaps between sections that cost block headers */
+	unsigned quiet, verbose;
+	int verbosity;                       /* 0 prints only what was asked for, 1 also lists the blocks read and written, 2 adds statistics */
+	const char *report;                  /* json or csv statistics on stdout, in place of the block listing */
+	FILE *listing;                       /* where tables asked for by other options go: stdout, or stderr when it is for the report */
+	const char *trace_file;              /* Chrome trace of the tool's own phases */
+	const char *timeline_file;           /* Chrome trace of the modelled boot, before and after */
+	const char *calibrate_file;          /* CSV of loader files and their measured boot times */
+	const char *capture_file;            /* logic analyzer capture (CSV) of the input image booting */
+	const char *capture_format;          /* spi (flash data on MISO) or uart */
+	unsigned scan;                       /* the input is a raw flash dump to be searched for loader streams */
+	const char *extract_prefix;          /* where each loader stream found by the scan is written */
+	unsigned threads;                    /* for the scan; zero for one per online processor */
+	const char *flash_offset;            /* where the loader stream is in a flash image (or auto); the rest of the image is kept */
+	unsigned erase_value;                /* what the space freed in the flash image is padded with */
+	const char *reference_file;          /* previous output image whose block offsets are to be kept where possible */
+	unsigned sector_size;                /* flash erase sector; the most padding worth spending to keep a block at its old offset */
+	unsigned diff;                       /* compare the two loader images named instead of optimizing */
+	const char *cache_dir;               /* output images by a hash of everything that went into them */
+};
+
+/*
+Stage-2 payload: a compact block table followed by the block payloads, for the application to load itself.
+All fields are little-endian 32-bit words.
+
+  header:  magic ("LDR2"), version (1), entry point, block count
+  entry:   target address, byte count, argument, flags (BFLAG_* values), file offset of payload
+
+FILL blocks have no payload (the argument is the fill value and the offset is meaningless) and INIT blocks are to be called after their
+payload is loaded, as the Boot ROM would.  Payloads are padded so that each starts on a 4-byte boundary.
+*/
+#define STAGE2_MAGIC   0x3252444C
+#define STAGE2_VERSION 1
+
+struct stage2_type
+{
+	int active;                /* set once the split point has been passed */
+	int loader_pending;        /* the fast loader is still to be written ... */
+	struct chunk_list_type *loader_after; /* ... immediately after this (split) INIT block, or after the First Block if NULL */
+	unsigned count;
+	struct buffer_type table, payload;
+};
+
+static struct stage2_type stage2;
+
+/*
+the sections and symbols of the ELF (.dxe) that the loader image was made from, and how much of the boot time each accounts for
+*/
+struct attribution_type
+{
+	const char *name;
+	unsigned address, length;
+	int zero_initialized; /* an initialized section whose contents are all zero, and so could be NOBITS (BSS) */
+	unsigned bytes;       /* how much of it is loaded by the boot stream */
+	double cost_us;
+};
+
+struct elf_type
+{
+	unsigned char *file;
+	unsigned section_count, symbol_count;
+	struct attribution_type *sections, *symbols;
+	double overhead_us;     /* headers of blocks that load nothing, e.g. First and Ignore Blocks */
+	double unattributed_us; /* loading memory that no section covers */
+};
+
+static struct elf_type elf;
+
+/*
+what the optimizations did, and how long each phase of the tool took
+*/
+#define MAX_PHASES 8
+
+struct span_type
+{
+	const char *name;
+	unsigned application;
+	double start_us, duration_us;
+};
+
+struct statistics_type
+{
+	unsigned input_blocks, output_blocks;
+	unsigned input_bytes, output_bytes;
+	unsigned fills_unrolled;
+	unsigned gaps_bridged;
+	unsigned overlaps_removed;
+	double input_us, output_us;
+	unsigned phase_count;
+	struct { const char *name; double start_us; unsigned allocations; double seconds; } phases[MAX_PHASES];
+	unsigned span_count, span_allocated;
+	struct span_type *spans;      /* finer-grained than the phases, e.g. each application */
+	double origin_us;
+};
+
+static struct statistics_type statistics;
+
+/* the output and input sections listed in a linker map file */
+static struct
+{
+	unsigned count;
+	struct attribution_type *sections;
+} linker_map;
+
+#define ELF_TOP_SYMBOLS 10
+
+/*
+a loader stream found in a raw flash dump; offsets are 64-bit, as dumps of several GB are commonplace
+*/
+#define MAX_SCAN_THREADS 64
+
+struct stream_type
+{
+	unsigned long long offset, length;
+	unsigned blocks, applications;
+	unsigned entry_point;
+};
+
+/*
+the blocks of a previous output image (--reference), so that those that have not changed can be written at the same stream offsets
+*/
+struct reference_block_type
+{
+	struct block_header_type hdr;
+	unsigned offset; /* of the header in the stream */
+	unsigned order;  /* of the block in the stream */
+	int used;
+};
+
+struct reference_type
+{
+	unsigned char *data;
+	unsigned length;
+	unsigned count, allocated;
+	struct reference_block_type *blocks; /* by target address, once loaded */
+	unsigned kept;                       /* blocks written at the same offset as in the reference */
+};
+
+static struct reference_type reference;
+
+/*
+a loader image as --diff sees it: its blocks (those that load something), and the memory that it leaves behind as a sparse list of
+pieces that point into the stream (or are filled) rather than copies, with whatever later blocks overwrite already cut away
+*/
+#define DIFF_PAGE 4096 /* changes closer together than this are reported as one range */
+
+struct stream_block_type
+{
+	struct block_header_type hdr;
+	unsigned offset;
+	unsigned long long hash; /* of the header fields and the payload */
+	int matched;
+};
+
+struct piece_type
+{
+	unsigned long long address, end;
+	unsigned base;             /* target address of the block, which data and fill are relative to */
+	const unsigned char *data; /* NULL for a FILL block */
+	unsigned char fill[4];
+	unsigned order;            /* later blocks overwrite earlier ones */
+};
+
+struct stream_image_type
+{
+	const unsigned char *data;
+	unsigned length;
+	int mapped;
+	unsigned count, allocated;
+	struct stream_block_type *blocks;
+	unsigned piece_count, pieces_allocated;
+	struct piece_type *pieces; /* by address, once resolved */
+};
+
+static struct stream_image_type *diff_image; /* the one that diff_block is adding to */
+
+/* each thread searches its own range of the dump for the First Block headers that a stream could start with */
+struct scan_job_type
+{
+	const unsigned char *dump;
+	unsigned long long dump_length;
+	unsigned long long start, end;
+	unsigned long long *candidates;
+	unsigned count, allocated;
+	unsigned allocations;
+};
+
+/* a SHA-256 digest in progress, for the --cache-dir key */
+struct sha256_type
+{
+	unsigned state[8];
+	unsigned long long length;
+	unsigned char block[64];
+	unsigned used;
+};
+
+enum option_kind { OPTION_STRING, OPTION_NUMBER, OPTION_HOOK, OPTION_FOOTPRINT };
+
+struct option_table_type
+{
+	const char *name;
+	enum option_kind kind;
+	void *value;
+};
+
+static struct option_settings_type options;
+
+/*
+how long the Boot ROM takes over one block, in the order that it does it: the header (including any handshake), transferring the
+payload, filling, and calling an INIT routine
+*/
+struct block_cost_type
+{
+	double header_us, transfer_us, fill_us, init_us;
+	double total_us;
+};
+
+/* called by estimate_stream for each block, with its offset in the stream and when it starts (in microseconds) */
+typedef void (*block_visitor)(const struct block_header_type *hdr, unsigned offset, double start_us, const struct block_cost_type *cost);
+
+static const struct option_table_type option_table[] =
+{
+	{ "fill-stub",         OPTION_STRING, &options.fill_stub_file },
+	{ "fill-stub-address", OPTION_NUMBER, &options.fill_stub_address },
+	{ "fill-table-address",OPTION_NUMBER, &options.fill_table_address },
+	{ "fill-batch-minimum",OPTION_NUMBER, &options.fill_batch_minimum },
+	{ "profile",           OPTION_STRING, &options.profile_file },
+	{ "hook",              OPTION_HOOK,   NULL },
+	{ "init-range",        OPTION_FOOTPRINT, NULL },
+	{ "split",             OPTION_STRING, &options.split },
+	{ "stage2",            OPTION_STRING, &options.stage2_file },
+	{ "fast-loader",       OPTION_STRING, &options.fast_loader_file },
+	{ "fast-loader-address", OPTION_NUMBER, &options.fast_loader_address },
+	{ "family",            OPTION_STRING, &options.family_name },
+	{ "memory-map",        OPTION_STRING, &options.memory_map_file },
+	{ "input-format",      OPTION_STRING, &options.input_format },
+	{ "output-format",     OPTION_STRING, &options.output_format },
+	{ "ihex-base",         OPTION_NUMBER, &options.ihex_base },
+	{ "host-table",        OPTION_STRING, &options.host_table_file },
+	{ "smallest-fill-block", OPTION_NUMBER, &options.smallest_fill_block },
+	{ "bridge",            OPTION_NUMBER, &options.bridge_max },
+	{ "max-size",          OPTION_NUMBER, &options.max_size },
+	{ "pareto",            OPTION_NUMBER, &options.pareto },
+	{ "page-size",         OPTION_NUMBER, &options.page_size },
+	{ "stream-align",      OPTION_NUMBER, &options.stream_align },
+	{ "dest-align",        OPTION_NUMBER, &options.dest_align },
+	{ "export-memory",     OPTION_STRING, &options.export_memory_prefix },
+	{ "elf",               OPTION_STRING, &options.elf_file },
+	{ "linker-map",        OPTION_STRING, &options.linker_map_file },
+	{ "advise",            OPTION_NUMBER, &options.advise },
+	{ "quiet",             OPTION_NUMBER, &options.quiet },
+	{ "verbose",           OPTION_NUMBER, &options.verbose },
+	{ "report",            OPTION_STRING, &options.report },
+	{ "trace",             OPTION_STRING, &options.trace_file },
+	{ "timeline",          OPTION_STRING, &options.timeline_file },
+	{ "calibrate",         OPTION_STRING, &options.calibrate_file },
+	{ "capture",           OPTION_STRING, &options.capture_file },
+	{ "capture-format",    OPTION_STRING, &options.capture_format },
+	{ "scan",              OPTION_NUMBER, &options.scan },
+	{ "extract",           OPTION_STRING, &options.extract_prefix },
+	{ "threads",           OPTION_NUMBER, &options.threads },
+	{ "flash-offset",      OPTION_STRING, &options.flash_offset },
+	{ "erase-value",       OPTION_NUMBER, &options.erase_value },
+	{ "reference",         OPTION_STRING, &options.reference_file },
+	{ "sector-size",       OPTION_NUMBER, &options.sector_size },
+	{ "diff",              OPTION_NUMBER, &options.diff },
+	{ "cache-dir",         OPTION_STRING, &options.cache_dir },
+};
+
+struct profile_table_type
+{
+	const char *name;
+	double *value;
+};
+
+static const struct profile_table_type profile_table[] =
+{
+	{ "header_us", &options.model.header_us },
+	{ "byte_ns",   &options.model.byte_ns },
+	{ "fill_ns",   &options.model.fill_ns },
+	{ "init_us",   &options.model.init_us },
+	{ "fastload_speedup",   &options.model.fastload_speedup },
+	{ "handshake_us",       &options.model.handshake_us },
+	{ "host_transfer_us",   &options.model.host_transfer_us },
+	{ "host_dma_max",       &options.model.host_dma_max },
+	{ "page_cross_us",      &options.model.page_cross_us },
+	{ "unaligned_us",       &options.model.unaligned_us },
+	{ "flash_lanes",        &options.board.flash_lanes },
+	{ "flash_clock_div",    &options.board.flash_clock_div },
+	{ "flash_read_command", &options.board.flash_read_command },
+	{ "flash_dummy_cycles", &options.board.flash_dummy_cycles },
+};
+
+static void write_header(struct buffer_type *handle, struct block_header_type *hdr);
+static int read_header(const unsigned char *data, struct block_header_type *hdr);
 static unsigned char calc_header_checksum(struct block_header_type *hdr);
-static void write_image(FILE *handle, struct chunk_list_type *list, struct image_settings_type *settings);
-static void copy_settings(struct image_settings_type *settings, struct block_header_type *hdr);
+static unsigned write_image(struct buffer_type *handle, struct chunk_list_type *list, struct image_settings_type *settings);
+static void append_application(struct application_list_type **applications, struct segment_list_type *segments, struct image_settings_type *settings);
+static struct segment_list_type *optimize_application(struct segment_list_type *segments);
+static unsigned write_application(struct buffer_type *handle, struct segment_list_type *segments, struct image_settings_type *settings);
+static void plan_size_budget(struct application_list_type *applications);
+static struct plan_type *make_plan(struct segment_list_type *segment);
+static int joinable_chunk(struct segment_list_type *segment, const struct chunk_list_type *chunk);
+static int gap_is_unused(struct plan_type *plans, unsigned address, unsigned length);
+static int compare_address(const void *a, const void *b);
+static int compare_candidate(const void *a, const void *b);
+static void apply_plan(struct plan_type *plan);
+static void align_destinations(struct application_list_type *applications);
+static struct plan_type *make_plans(struct application_list_type *applications);
+static void free_plans(struct plan_type *plans);
+static void begin_phase(const char *name);
+static double now_us(void);
+static void record_span(const char *name, unsigned application, double start_us);
+static unsigned peak_rss_kb(void);
+static int write_trace(const char *name);
+static int write_report(const char *format);
+static void advise_layout(struct application_list_type *applications);
+static int load_linker_map(const char *name);
+static const struct attribution_type *find_section(unsigned address);
+static int header_straddles(unsigned offset);
+static int payload_unaligned(unsigned offset, unsigned address, unsigned length);
+static unsigned choose_padding(unsigned offset, const struct chunk_list_type *chunk);
+static void write_padding(struct buffer_type *handle, unsigned length, struct image_settings_type *settings);
+static void paint_extent(struct extent_type **extents, unsigned address, const unsigned char *data, unsigned length);
+static struct extent_type *memory_image(struct application_list_type *applications);
+static void free_extents(struct extent_type *extents);
+static unsigned region_piece(unsigned address, unsigned length);
+static int export_memory(const char *prefix, struct extent_type *extents);
+static struct chunk_list_type *import_memory(const char *name, unsigned *count);
+static struct chunk_list_type **synthesize_chunks(struct chunk_list_type **tail, unsigned address, const unsigned char *data, unsigned length);
+static struct chunk_list_type **append_chunk(struct chunk_list_type **tail, unsigned address, unsigned flags, unsigned argument, const unsigned char *data, unsigned length);
+static int load_elf(const char *name);
+static unsigned elf_value(const unsigned char *data, unsigned size);
+static void attribute_block(const struct block_header_type *hdr, unsigned offset, double start_us, const struct block_cost_type *cost);
+static int write_timeline(const char *name, const unsigned char *input, unsigned input_length, const unsigned char *output, unsigned output_length);
+static void timeline_block(const struct block_header_type *hdr, unsigned offset, double start_us, const struct block_cost_type *cost);
+static void timeline_span(const char *name, double start_us, double duration_us);
+static int calibrate(const char *name, const char *profile);
+static int solve_least_squares(double *matrix, double *vector, unsigned size);
+static int write_profile(const char *name);
+static int load_capture(const char *name);
+static int capture_column(char *line, const char *const *names);
+static char *csv_field(char **line);
+static void capture_block(const struct block_header_type *hdr, unsigned offset, double start_us, const struct block_cost_type *cost);
+static void compare_capture(const unsigned char *data, unsigned length);
+static int scan_dump(const char *name);
+static struct stream_type *find_streams(const unsigned char *dump, unsigned long long dump_length, unsigned thread_count, unsigned *count);
+static unsigned scan_threads(void);
+static void *scan_range(void *argument);
+static unsigned char *embedded_stream(unsigned char *flash, unsigned flash_length, struct stream_type *stream, unsigned *length);
+static int load_reference(const char *name);
+static void reference_block(const struct block_header_type *hdr, unsigned offset, double start_us, const struct block_cost_type *cost);
+static int compare_reference_block(const void *a, const void *b);
+static unsigned reference_lower_bound(unsigned address);
+static unsigned reference_rank(const struct chunk_list_type *chunk);
+static int reference_padding(unsigned offset, const struct chunk_list_type *chunk);
+static struct chunk_list_type *follow_reference(struct chunk_list_type *list);
+static void compare_reference(const unsigned char *data, unsigned length);
+static unsigned changed_sectors(const unsigned char *new_data, unsigned new_length, const unsigned char *old_data, unsigned old_length, unsigned *sectors);
+static int diff_images(const char *old_name, const char *new_name);
+static int load_stream_image(const char *name, struct stream_image_type *image);
+static void diff_block(const struct block_header_type *hdr, unsigned offset, double start_us, const struct block_cost_type *cost);
+static int compare_stream_block(const void *a, const void *b);
+static void resolve_pieces(struct stream_image_type *image);
+static int compare_piece(const void *a, const void *b);
+static int compare_bound(const void *a, const void *b);
+static unsigned char piece_byte(const struct piece_type *piece, unsigned long long address);
+static void diff_memory(struct stream_image_type *old_image, struct stream_image_type *new_image, unsigned long long *totals);
+static void diff_pieces(const struct piece_type *old_piece, const struct piece_type *new_piece, unsigned long long low, unsigned long long high, unsigned long long *totals);
+static void report_range(int kind, unsigned long long low, unsigned long long high);
+static unsigned long long hash_bytes(unsigned long long hash, const void *data, unsigned length);
+static void diff_blocks(struct stream_image_type *old_image, struct stream_image_type *new_image, unsigned *totals);
+static void print_block(const char *what, const struct stream_block_type *block);
+static int cache_usable(void);
+static int make_directory(const char *path);
+static void sha256_init(struct sha256_type *context);
+static void sha256_update(struct sha256_type *context, const void *data, unsigned long long length);
+static void sha256_final(struct sha256_type *context, unsigned char *digest);
+static void sha256_block(struct sha256_type *context, const unsigned char *block);
+static void cache_path(char *path, unsigned size, const unsigned char *input, unsigned input_length, char **args, int arg_count, const char *entry);
+static int cache_fetch(const char *path, const char *output_name);
+static void cache_store(const char *output_name, const char *path);
+static int copy_file(const char *from, const char *to);
+static int follow_stream(const unsigned char *dump, unsigned long long dump_length, unsigned long long offset, struct stream_type *stream);
+static const unsigned char *map_file(const char *name, unsigned long long *length);
+static void unmap_file(const unsigned char *data, unsigned long long length);
+static void print_attribution(struct attribution_type *items, unsigned count, unsigned limit, double total);
+static int compare_attribution(const void *a, const void *b);
 static void print_flags(unsigned flags, unsigned arguments);
+static void add_stage2(struct chunk_list_type *list);
+static int write_stage2(const char *name, unsigned entry_point);
+static void finish_stage2(struct buffer_type *stage, unsigned entry_point);
+static void write_fast_loader(struct buffer_type *handle, struct image_settings_type *settings);
+static void collect_fast_load(struct application_list_type *applications);
+static int load_memory_map(const char *name);
+static const struct region_type *find_region(unsigned address);
+static int same_region(unsigned address, unsigned length, unsigned other_address, unsigned other_length);
+static int in_ram_region(unsigned address, unsigned length);
+static int is_barrier(const struct chunk_list_type *chunk);
+static unsigned char *decode_input(unsigned char *raw, unsigned *length);
+static int is_text(const unsigned char *data, unsigned length);
+static unsigned char *decode_text(const unsigned char *text, unsigned *length);
+static unsigned char *decode_ihex(const unsigned char *text, unsigned *length);
+static int encode_output(FILE *handle, const unsigned char *data, unsigned length);
+static unsigned host_transfer_count(unsigned length);
+static int write_host_table(const char *name, const unsigned char *data, unsigned length);
+static int parse_option(const char *arg);
+static int parse_hook(const char *value);
+static int parse_footprint(struct footprint_type *footprint, const char *value, char **end);
+static int parse_init_range(const char *value);
+static const struct footprint_type *find_footprint(unsigned address);
+static void merge_across_inits(struct segment_list_type *segments);
+static int overlaps_other_chunk(struct segment_list_type *segment, const struct chunk_list_type *chunk);
+static void join_chunks(struct chunk_list_type *low, struct chunk_list_type *high, struct chunk_list_type *keep);
+static int load_profile(const char *name);
+static void buffer_append(struct buffer_type *buffer, const void *data, unsigned length);
+static void append_segment(struct segment_list_type **segments, struct chunk_list_type *chunks);
+static double estimate_stream(const unsigned char *data, unsigned length, block_visitor visit);
+static struct segment_list_type *hoist_hook(struct segment_list_type *segments, const struct hook_type *hook);
+static int overlaps_marked_chunk(struct segment_list_type *start, struct segment_list_type *stop, const struct chunk_list_type *chunk);
+static int chunk_in_footprint(const struct chunk_list_type *chunk, const struct footprint_type *footprint);
+static int marked_in_footprint(struct segment_list_type *start, struct segment_list_type *stop, const struct footprint_type *footprint);
+static unsigned char *load_file(const char *name, unsigned *length);
+static int ranges_overlap(unsigned a_address, unsigned a_length, unsigned b_address, unsigned b_length);
+static int fill_is_batchable(struct chunk_list_type *list, struct chunk_list_type *fill);
+static struct chunk_list_type *batch_fill_blocks(struct chunk_list_type *list);
 
-#define CUSTOMIZE_SMALLEST_FILL_BLOCK 256
+#define CUSTOMIZE_SMALLEST_FILL_BLOCK 256 /* default for --smallest-fill-block */
 
 int main(int argc, char *argv[])
 {
-	FILE *input, *output;
+	FILE *output;
+	unsigned char *input, *flash = NULL;
+	unsigned input_length, flash_length = 0;
+	struct stream_type stream;
+	struct buffer_type image;
 	struct block_header_type hdr;
 	unsigned position;
-	unsigned char checksum;
 	struct chunk_list_type *list = NULL;
+	struct segment_list_type *segments = NULL;
+	struct application_list_type *applications = NULL, *application;
 	struct chunk_list_type *current, *previous, *additional;
+	struct extent_type *extents;
 	unsigned additional_bytes;
 	struct image_settings_type settings;
 	unsigned input_block_count, output_block_count;
 	unsigned char *ptr;
+	char **positional;
+	char cache_file[1024];
+	int use_cache, option_count;
+	double total_us, start_us;
+	unsigned index;
+	int arg, last_block;
+
+	statistics.origin_us = now_us();
+
+	/* defaults; the timing model is only a rough guide for a SPI flash boot and should be calibrated with --profile */
+	options.fill_batch_minimum = 4;
+	options.smallest_fill_block = CUSTOMIZE_SMALLEST_FILL_BLOCK;
+	options.size_slack = 0xFFFFFFFF;
+	options.format = &v2_format;
+	options.input_format = "auto";
+	options.output_format = "binary";
+	options.capture_format = "spi";
+	options.erase_value = 0xFF;
+	options.sector_size = 4096;
+	options.model.header_us = 80.0;
+	options.model.byte_ns = 320.0;
+	options.model.fill_ns = 2.0;
+	options.model.init_us = 10.0;
+	options.model.fastload_speedup = 4.0;
+	options.model.host_dma_max = 65536.0;
+	options.board.flash_lanes = 4.0;
+	options.board.flash_clock_div = 1.0;
+	options.board.flash_read_command = 0x6B;
+	options.board.flash_dummy_cycles = 8.0;
+
+	/* options of the form "--name=value" precede the positional arguments */
+	for (arg = 1; (arg < argc) && !strncmp(argv[arg], "--", 2); arg++)
+	{
+		if (parse_option(argv[arg]))
+		{
+			fprintf(stderr, "ERROR: unrecognized option %s\n", argv[arg]);
+			return -1;
+		}
+	}
+
+	positional = argv + arg;
+	option_count = arg - 1;
+	argc -= arg;
+
+	options.verbosity = 1 - (int)options.quiet + (int)options.verbose;
+	options.listing = stdout;
+
+	if (options.report)
+	{
+		if (strcmp(options.report, "json") && strcmp(options.report, "csv"))
+		{
+			fprintf(stderr, "ERROR: unknown report format %s\n", options.report);
+			return -1;
+		}
+
+		if (options.calibrate_file || options.scan || options.extract_prefix || options.diff)
+		{
+			fprintf(stderr, "ERROR: --report cannot be combined with --calibrate, --scan, --extract or --diff\n");
+			return -1;
+		}
+
+		options.verbosity = 0; /* stdout is for the report alone */
+		options.listing = stderr;
+	}
+
+	/* extracting the streams found implies scanning for them */
+	if (options.extract_prefix)
+		options.scan = 1;
+
+	if (argc < ((options.calibrate_file || options.scan) ? 1 : 2))
+	{
+		fprintf(stderr, "%s [options] <input_ldr> <output_ldr> [entry_addr]\n", argv[0]);
+		fprintf(stderr, "%s [options] --diff <old_ldr> <new_ldr>\n", argv[0]);
+		fprintf(stderr, "%s [options] --calibrate=<measurements_csv> <output_profile>\n", argv[0]);
+		fprintf(stderr, "%s [options] --scan|--extract=<prefix> <flash_dump>\n", argv[0]);
+		return -1;
+	}
+
+	/* with a size budget, every FILL block is left alone until it is known which are worth unrolling */
+	if (options.max_size)
+		options.smallest_fill_block = 0;
+
+	if (options.fill_stub_file)
+	{
+		options.fill_stub = load_file(options.fill_stub_file, &options.fill_stub_length);
+
+		if (NULL == options.fill_stub)
+		{
+			fprintf(stderr, "ERROR: unable to open fill stub file\n");
+			return -1;
+		}
+	}
+
+	if (options.split)
+		options.split_address = strtoul(options.split, NULL, 0);
+
+	if (options.stage2_file && !options.split)
+	{
+		fprintf(stderr, "ERROR: --stage2 needs --split to say where stage 1 ends\n");
+		return -1;
+	}
+
+	if (options.fast_loader_file && options.stage2_file)
+	{
+		fprintf(stderr, "ERROR: the fast loader carries stage 2 itself; --stage2 cannot also be used\n");
+		return -1;
+	}
+
+	if (options.fast_loader_file)
+	{
+		options.fast_loader = load_file(options.fast_loader_file, &options.fast_loader_length);
+
+		if (NULL == options.fast_loader)
+		{
+			fprintf(stderr, "ERROR: unable to open fast loader file\n");
+			return -1;
+		}
+	}
+
+	if (options.family_name)
+	{
+		for (arg = 0; arg < (int)(sizeof(family_table) / sizeof(family_table[0])); arg++)
+			if (!strcmp(family_table[arg].name, options.family_name))
+				break;
+
+		if (arg == (int)(sizeof(family_table) / sizeof(family_table[0])))
+		{
+			fprintf(stderr, "ERROR: unknown processor family %s\n", options.family_name);
+			return -1;
+		}
+
+		options.format = family_table[arg].format;
+		options.regions = family_table[arg].regions;
+		options.region_count = family_table[arg].region_count;
+	}
+
+	if (options.memory_map_file)
+	{
+		if (load_memory_map(options.memory_map_file))
+		{
+			fprintf(stderr, "ERROR: unable to read memory map file\n");
+			return -1;
+		}
+	}
+
+	if (options.profile_file)
+	{
+		if (load_profile(options.profile_file))
+		{
+			fprintf(stderr, "ERROR: unable to read profile file\n");
+			return -1;
+		}
+	}
+
+	if (options.elf_file)
+	{
+		if (load_elf(options.elf_file))
+		{
+			fprintf(stderr, "ERROR: unable to read ELF file\n");
+			return -1;
+		}
+	}
+
+	if (options.capture_file)
+	{
+		if (load_capture(options.capture_file))
+		{
+			fprintf(stderr, "ERROR: unable to read %s capture file\n", options.capture_format);
+			return -1;
+		}
+	}
+
+	if (options.linker_map_file)
+	{
+		if (load_linker_map(options.linker_map_file))
+		{
+			fprintf(stderr, "ERROR: unable to read linker map file\n");
+			return -1;
+		}
+	}
+
+	if (options.reference_file)
+	{
+		if (!options.sector_size)
+		{
+			fprintf(stderr, "ERROR: --sector-size cannot be zero\n");
+			return -1;
+		}
+
+		if (load_reference(options.reference_file))
+		{
+			fprintf(stderr, "ERROR: unable to read reference file\n");
+			return -1;
+		}
+	}
+
+	if (options.calibrate_file)
+	{
+		if (calibrate(options.calibrate_file, positional[0]))
+		{
+			fprintf(stderr, "ERROR: unable to calibrate the timing model\n");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (options.flash_offset)
+	{
+		/* the rest of the flash image is copied through untouched, which only makes sense of a binary image */
+		if (!strcmp(options.input_format, "auto"))
+			options.input_format = "binary";
+
+		if (strcmp(options.input_format, "binary") || strcmp(options.output_format, "binary"))
+		{
+			fprintf(stderr, "ERROR: a flash image can only be read and written in binary\n");
+			return -1;
+		}
+	}
+
+	if ( (options.scan || options.flash_offset) && (options.format != &v2_format) )
+	{
+		fprintf(stderr, "ERROR: only loader streams with checksummed headers can be found in a flash image\n");
+		return -1;
+	}
+
+	if (options.diff)
+	{
+		if (diff_images(positional[0], positional[1]))
+		{
+			fprintf(stderr, "ERROR: unable to compare loader images\n");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (options.scan)
+	{
+		if (scan_dump(positional[0]))
+		{
+			fprintf(stderr, "ERROR: unable to scan flash dump\n");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	begin_phase("read");
+
+	use_cache = 0;
+
+	if (!strcmp(options.input_format, "memory"))
+	{
+		/* a memory image has no loader stream; its blocks are synthesized instead of parsed */
+		input = (unsigned char *)malloc(1);
+		input_length = 0;
+	}
+	else
+	{
+		input = load_file(positional[0], &input_length);
+
+		if (NULL == input)
+		{
+			fprintf(stderr, "ERROR: unable to open input file\n");
+			return -1;
+		}
+
+		use_cache = options.cache_dir && cache_usable();
+
+		if (use_cache && make_directory(options.cache_dir))
+		{
+			fprintf(stderr, "ERROR: unable to create cache directory %s\n", options.cache_dir);
+			return -1;
+		}
+
+		if (use_cache)
+		{
+			cache_path(cache_file, sizeof(cache_file), input, input_length, argv + 1, option_count, (argc > 2) ? positional[2] : NULL);
+
+			if (!cache_fetch(cache_file, positional[1]))
+			{
+				if (options.verbosity >= 1)
+					printf("--- cached %s\n", cache_file);
+
+				free(input);
+				return 0;
+			}
+		}
+
+		input = decode_input(input, &input_length);
+
+		if (NULL == input)
+		{
+			fprintf(stderr, "ERROR: unable to decode input file as %s\n", options.input_format);
+			return -1;
+		}
+
+		if (options.flash_offset)
+		{
+			/* from here on, the input is the loader stream alone */
+			flash = input;
+			flash_length = input_length;
+			input = embedded_stream(flash, flash_length, &stream, &input_length);
+
+			if (NULL == input)
+				return -1;
+
+			if (options.verbosity >= 1)
+				printf("--- flash image: loader stream at 0x%llx, 0x%llx bytes\n", stream.offset, stream.length);
+		}
+	}
+
+	memset(&image, 0, sizeof(image));
+	memset(&settings, 0, sizeof(settings));
+	position = 0;
+	input_block_count = output_block_count = 0;
+
+	begin_phase("parse");
+
+	if (!strcmp(options.input_format, "memory"))
+	{
+		list = import_memory(positional[0], &input_block_count);
+
+		if (NULL == list)
+		{
+			fprintf(stderr, "ERROR: unable to read memory image\n");
+			return -1;
+		}
+
+		settings.hdrsign = BLOCK_HDRSIGN;
+
+		if (argc > 2)
+		{
+			settings.entry_point = strtoul(positional[2], NULL, 0);
+		}
+		else
+		{
+			settings.entry_point = list->address;
+			fprintf(stderr, "WARNING: no entry address given; using 0x%x\n", settings.entry_point);
+		}
+	}
+
+	while (position + options.format->header_size <= input_length)
+	{
+		/* stop execution if the header is invalid (e.g. the checksum failed) */
+		if (read_header(input + position, &hdr))
+		{
+			fprintf(stderr, "ERROR: checksum failed @ 0x%02x\n", position);
+			return -1;
+		}
+
+		/* keep track of position (and print for diagnostic purposes) */
+		position += options.format->header_size;
+
+		/* in some formats, the Final Block is also an ordinary block that has to be processed */
+		last_block = 0;
+		if ( (hdr.block_code.flags & BFLAG_FINAL) && options.format->final_has_payload )
+		{
+			hdr.block_code.flags &= ~BFLAG_FINAL;
+			last_block = 1;
+		}
+
+		if ( !(hdr.block_code.flags & (BFLAG_FIRST | BFLAG_FINAL)) && (options.verbosity >= 1) )
+		{
+			printf("0x%x 0x%x", hdr.target_address, hdr.byte_count);
+			print_flags(hdr.block_code.flags, hdr.argument);
+		}
+
+		if (hdr.block_code.flags & (BFLAG_FIRST | BFLAG_FINAL))
+		{
+			append_segment(&segments, list);
+			list = NULL;
+
+			if (segments)
+			{
+				append_application(&applications, segments, &settings);
+				segments = NULL;
+			}
+		}
+
+		/* bail while loop if we've reached the end */
+		if (hdr.block_code.flags & BFLAG_FINAL)
+		{
+			break;
+		}
+
+		/* if this is a First Block, we note the entry point address and immediately loop again to read the next block */
+		if (hdr.block_code.flags & BFLAG_FIRST)
+		{
+			settings.entry_point = hdr.target_address;
+			settings.hdrsign = hdr.block_code.hdrsign;
+			settings.bcode = hdr.block_code.bcode;
+			
+			if (options.verbosity >= 1)
+				printf("--- read 0x%02x entry 0x%x\n", hdr.block_code.hdrsign, hdr.target_address);
+
+			if (argc > 2) /* re-write entry address if provided with one */
+				settings.entry_point = strtoul(positional[2], NULL, 0);
+
+			continue;
+		}
+
+		input_block_count++;
+
+		/* this also keeps a corrupt Ignore Block from wrapping position around */
+		if ( !(hdr.block_code.flags & BFLAG_FILL) && (hdr.byte_count > input_length - position) )
+		{
+			fprintf(stderr, "ERROR: truncated block @ 0x%02x\n", position);
+			return -1;
+		}
+
+		/* if this is an Ignore Block (other than a First Block), we throw away the data */
+		if (hdr.block_code.flags & BFLAG_IGNORE)
+		{
+			position += hdr.byte_count;
+			if (last_block)
+				break;
+			continue;
+		}
+
+		/* find the right place to insert the data into the linked list */
+
+		current = list;
+		previous = NULL;
+		additional = NULL;
+
+		while (current)
+		{
+			if (hdr.block_code.flags & ~BFLAG_FILL)
+				goto not_a_match; /* skip check if any bit other than BFLAG_FILL is set; we'll just arrive at the end of the linked list */
+
+			if ( (hdr.block_code.flags & BFLAG_FILL) && (hdr.byte_count > options.smallest_fill_block) )
+				goto not_a_match; /* this FILL block is too large to justify unrolling; we'll just arrive at the end of the linked list  */
+
+			if (current->flags & BFLAG_FILL)
+				goto not_a_match; /* segregate: do not join to existing FILL blocks */
+
+			if (!same_region(current->address, current->length, hdr.target_address, hdr.byte_count))
+				goto not_a_match; /* never join blocks across a memory region boundary (and never join MMR writes) */
+
+			if ( ( hdr.target_address >= current->address ) && ( hdr.target_address <= (current->address + current->length)) )
+			{
+				/* this block is contiguous with an already seen block */
+				additional = current;
+				break;
+			}
+
+not_a_match:
+			previous = current;
+			current = current->next;
+		}
+
+		/* determine whether we need to add an additional entry */
+
+		if (!additional)
+		{
+			/* an additional entry is needed, so we create it and add it to the list */
+
+			additional = (struct chunk_list_type *)malloc(sizeof(struct chunk_list_type));
+			memset(additional, 0, sizeof(struct chunk_list_type));
+			additional->address = hdr.target_address;
+			additional->argument = hdr.argument;
+			additional->flags = hdr.block_code.flags;
+
+			if (previous)
+				previous->next = additional;
+			else
+				list = additional;
+
+			additional->next = current;
+		}
+
+		if ( hdr.byte_count && (hdr.target_address < additional->address + additional->length) )
+			statistics.overlaps_removed++;
+
+		/* compute how many bytes are being added to this entry (whether the entry is additional or existing) */
+
+		if ( (hdr.target_address + hdr.byte_count) > (additional->address + additional->length) )
+		{
+			additional_bytes = (hdr.target_address + hdr.byte_count) - (additional->address + additional->length);
+
+			if (hdr.block_code.flags & BFLAG_FILL)
+			{
+				/* this is a Fill Block... we append if and only if the current Block isn't also a Fill Block */
+				if (!(additional->flags & BFLAG_FILL))
+				{
+					statistics.fills_unrolled++;
+					additional->data = realloc(additional->data, additional->length + additional_bytes);
+					ptr = additional->data + (hdr.target_address - additional->address);
+					while (hdr.byte_count >= sizeof(hdr.argument))
+					{
+						memcpy(ptr, &hdr.argument, sizeof(hdr.argument));
+						ptr += sizeof(hdr.argument);
+						hdr.byte_count -= sizeof(hdr.argument);
+					}
+				}
+			}
+			else
+			{
+				/* this is not a Fill Block, so we read in the data */
+				additional->data = realloc(additional->data, additional->length + additional_bytes);
+				memcpy(additional->data + (hdr.target_address - additional->address), input + position, hdr.byte_count);
+			}
+
+			/* update the entry length to reflect the added data */
+			additional->length += additional_bytes;
+		}
+		else
+		{
+			if (hdr.byte_count)
+				fprintf(stderr, "WARNING: memory overwrite in region 0x%x to 0x%x\n", hdr.target_address, hdr.target_address + hdr.byte_count);
+		}
+
+		/* keep track of position */
+		if (!(hdr.block_code.flags & BFLAG_FILL))
+			position += hdr.byte_count;
+
+		/* INIT blocks and MMR writes are barriers that no block may be moved across */
+		if (is_barrier(additional))
+		{
+			append_segment(&segments, list);
+			list = NULL;
+		}
+
+		if (last_block)
+			break;
+	}
+
+	/* a Final Block that was also an ordinary block leaves the last application to be written */
+	append_segment(&segments, list);
+	list = NULL;
+
+	if (segments)
+	{
+		append_application(&applications, segments, &settings);
+		segments = NULL;
+	}
+
+	if (options.export_memory_prefix)
+	{
+		extents = memory_image(applications);
+
+		if (export_memory(options.export_memory_prefix, extents))
+		{
+			fprintf(stderr, "ERROR: unable to write memory image\n");
+			return -1;
+		}
+
+		free_extents(extents);
+	}
+
+	/* whole-image optimizations, and then the new loader image is written */
+
+	begin_phase("optimize");
+
+	for (application = applications, index = 0; application; application = application->next, index++)
+	{
+		start_us = now_us();
+		application->segments = optimize_application(application->segments);
+		record_span("optimize application", index, start_us);
+	}
+
+	if (options.bridge_max || options.max_size || options.pareto)
+		plan_size_budget(applications);
+
+	if (options.dest_align)
+		align_destinations(applications);
+
+	if (options.advise)
+		advise_layout(applications);
+
+	begin_phase("write");
+
+	if (options.fast_loader)
+		collect_fast_load(applications);
+
+	for (index = 0; applications; index++)
+	{
+		start_us = now_us();
+		output_block_count += write_application(&image, applications->segments, &applications->settings);
+		record_span("write application", index, start_us);
+		application = applications;
+		applications = applications->next;
+		free(application);
+	}
+
+	/* finish the output file with the Final Block */
+
+	hdr.block_code.flags = BFLAG_FINAL;
+	hdr.target_address = settings.entry_point;
+	hdr.argument = 0;
+	hdr.byte_count = 0;
+
+	options.format->write_final(&image, &hdr);
+
+	/* a flash image only has room for as long a stream as it had; anything longer would overwrite what follows */
+	if (flash && (image.length > stream.length))
+	{
+		fprintf(stderr, "WARNING: the output (%u bytes) does not fit in the 0x%llx bytes of the loader stream in the flash image; the original stream is kept\n", image.length, stream.length);
+		image.length = 0;
+		buffer_append(&image, input, input_length);
+		output_block_count = input_block_count;
+	}
+
+	if (options.max_size && (image.length > options.max_size))
+	{
+		fprintf(stderr, "ERROR: the output (%u bytes) exceeds --max-size\n", image.length);
+		return -1;
+	}
+
+	/* the output is only opened (and so truncated) once it is certain that there is something to write to it */
+	output = fopen(positional[1], "wb");
+
+	if (NULL == output)
+	{
+		fprintf(stderr, "ERROR: unable to open output file\n");
+		return -1;
+	}
+
+	if (flash)
+	{
+		/* the new stream is patched over the old one, and the space that it no longer needs is left erased */
+		memcpy(flash + stream.offset, image.data, image.length);
+		memset(flash + stream.offset + image.length, options.erase_value, stream.length - image.length);
+		fwrite(flash, 1, flash_length, output);
+		free(flash);
+	}
+	else if (encode_output(output, image.data, image.length))
+	{
+		fprintf(stderr, "ERROR: unknown output format %s\n", options.output_format);
+		fclose(output);
+		remove(positional[1]);
+		return -1;
+	}
+	fclose(output);
+
+	if (use_cache)
+		cache_store(positional[1], cache_file);
+
+	if (options.host_table_file)
+	{
+		if (write_host_table(options.host_table_file, image.data, image.length))
+		{
+			fprintf(stderr, "ERROR: unable to open host table file\n");
+			return -1;
+		}
+	}
+
+	if (options.stage2_file)
+	{
+		if (!stage2.active)
+			fprintf(stderr, "WARNING: no INIT block at 0x%x; the stage-2 payload is empty\n", options.split_address);
+
+		if (write_stage2(options.stage2_file, settings.entry_point))
+		{
+			fprintf(stderr, "ERROR: unable to open stage-2 file\n");
+			return -1;
+		}
+	}
+
+	/* provide some metrics on how much the loader image has been simplified */
+	begin_phase("estimate");
+
+	statistics.input_blocks = input_block_count;
+	statistics.output_blocks = output_block_count;
+	statistics.input_bytes = input_length;
+	statistics.output_bytes = image.length;
+	statistics.input_us = estimate_stream(input, input_length, NULL);
+	statistics.output_us = estimate_stream(image.data, image.length, NULL);
+
+	if (options.verbosity >= 1)
+	{
+		printf("---\n%d blocks read; %d blocks written\n", input_block_count, output_block_count);
+		printf("estimated boot time %.0f us; %.0f us\n", statistics.input_us, statistics.output_us);
+	}
+
+	if (options.reference_file)
+		compare_reference(image.data, image.length);
+
+	if (options.elf_file)
+	{
+		total_us = estimate_stream(image.data, image.length, attribute_block);
+
+		fprintf(options.listing, "--- boot time by section\n");
+		print_attribution(elf.sections, elf.section_count, elf.section_count, total_us);
+		fprintf(options.listing, "%8.0f us %5.1f%%  (memory outside of any section)\n", elf.unattributed_us, total_us ? 100.0 * elf.unattributed_us / total_us : 0.0);
+		fprintf(options.listing, "%8.0f us %5.1f%%  (blocks that load nothing)\n", elf.overhead_us, total_us ? 100.0 * elf.overhead_us / total_us : 0.0);
+
+		fprintf(options.listing, "--- boot time by symbol (top %d)\n", ELF_TOP_SYMBOLS);
+		print_attribution(elf.symbols, elf.symbol_count, ELF_TOP_SYMBOLS, total_us);
+	}
+
+	if (options.capture_file)
+		compare_capture(input, input_length);
+
+	begin_phase(NULL);
+
+	if (options.verbosity >= 2)
+		write_report("text");
+
+	if (options.report)
+		write_report(options.report);
+
+	if (options.timeline_file && write_timeline(options.timeline_file, input, input_length, image.data, image.length))
+	{
+		fprintf(stderr, "ERROR: unable to open timeline file\n");
+		return -1;
+	}
+
+	if (options.trace_file && write_trace(options.trace_file))
+	{
+		fprintf(stderr, "ERROR: unable to open trace file\n");
+		return -1;
+	}
+
+	free(input);
+	free(image.data);
+
+	return 0;
+}
+
+static void write_header(struct buffer_type *handle, struct block_header_type *hdr)
+{
+	options.format->write_header(handle, hdr);
+}
+
+static int read_header(const unsigned char *data, struct block_header_type *hdr)
+{
+	return options.format->read_header(data, hdr);
+}
+
+static int read_header_v2(const unsigned char *data, struct block_header_type *hdr)
+{
+	memcpy(hdr, data, sizeof(struct block_header_type));
+
+	/* compute the XOR checksum; the checksum passes only when it calculates to zero */
+	return calc_header_checksum(hdr);
+}
+
+/*
+The legacy header is translated to and from the block_header_type representation.  The flag bits that select
+the resume vector and the host wait strobe apply to the whole stream, so they are carried over from the input.
+*/
+
+static unsigned legacy_stream_flags;
+static unsigned legacy_last_header;
+
+static int read_header_legacy(const unsigned char *data, struct block_header_type *hdr)
+{
+	unsigned flag;
+
+	memset(hdr, 0, sizeof(struct block_header_type));
+	memcpy(&hdr->target_address, data + 0, 4);
+	memcpy(&hdr->byte_count, data + 4, 4);
+	flag = data[8] | (data[9] << 8);
+
+	/* there is no checksum, but undefined flag bits are a sure sign of a corrupt stream */
+	if (flag & ~(LFLAG_ZEROFILL | LFLAG_RESVECT | LFLAG_INIT | LFLAG_IGNORE | LFLAG_PFLAG | LFLAG_PPORT | LFLAG_FINAL))
+		return -1;
+
+	legacy_stream_flags = flag & (LFLAG_RESVECT | LFLAG_PFLAG | LFLAG_PPORT);
+
+	if (flag & LFLAG_ZEROFILL)
+		hdr->block_code.flags |= BFLAG_FILL; /* argument (the fill value) is zero */
+	if (flag & LFLAG_INIT)
+		hdr->block_code.flags |= BFLAG_INIT;
+	if (flag & LFLAG_IGNORE)
+		hdr->block_code.flags |= BFLAG_IGNORE;
+	if (flag & LFLAG_FINAL)
+		hdr->block_code.flags |= BFLAG_FINAL;
+
+	return 0;
+}
+
+static void write_header_legacy(struct buffer_type *handle, struct block_header_type *hdr)
+{
+	unsigned char data[LEGACY_HEADER_SIZE];
+	unsigned flag;
+
+	flag = legacy_stream_flags;
+
+	if (hdr->block_code.flags & BFLAG_FILL)
+	{
+		flag |= LFLAG_ZEROFILL;
+		if (hdr->argument)
+			fprintf(stderr, "WARNING: legacy format can only fill with zero (block at 0x%x)\n", hdr->target_address);
+	}
+	if (hdr->block_code.flags & BFLAG_INIT)
+		flag |= LFLAG_INIT;
+	if (hdr->block_code.flags & BFLAG_IGNORE)
+		flag |= LFLAG_IGNORE;
+	if (hdr->block_code.flags & BFLAG_FINAL)
+		flag |= LFLAG_FINAL;
+
+	memcpy(data + 0, &hdr->target_address, 4);
+	memcpy(data + 4, &hdr->byte_count, 4);
+	data[8] = flag & 0xFF;
+	data[9] = flag >> 8;
+
+	legacy_last_header = handle->length;
+	buffer_append(handle, data, sizeof(data));
+}
+
+static void write_final_legacy(struct buffer_type *handle, struct block_header_type *hdr)
+{
+	/* there is no separate Final Block; instead, the last block written is flagged as such */
+	if (handle->length)
+		handle->data[legacy_last_header + 9] |= LFLAG_FINAL >> 8;
+	else
+		fprintf(stderr, "WARNING: no blocks at 0x%x to flag as final\n", hdr->target_address);
+}
+
+static void write_header_v2(struct buffer_type *handle, struct block_header_type *hdr)
+{
+	/* set checksum to zero so that... */
+	hdr->block_code.hdrchk = 0;
+	/* ...the calculated result will be the correct checksum */
+	hdr->block_code.hdrchk = calc_header_checksum(hdr);
+
+	buffer_append(handle, hdr, sizeof(struct block_header_type));
+}
+
+static unsigned char calc_header_checksum(struct block_header_type *hdr)
+{
+	unsigned char checksum;
+	unsigned index;
+
+	/* checksum is an XOR of all bytes in the header */
+	checksum = 0;
+	for (index = 0; index < sizeof(struct block_header_type); index++)
+		checksum ^= *((unsigned char *)hdr + index);
+
+	return checksum;
+}
+
+static unsigned write_image(struct buffer_type *handle, struct chunk_list_type *list, struct image_settings_type *settings)
+{
+	struct chunk_list_type *current, *previous;
+	unsigned first, padding, count;
+	struct block_header_type hdr;
+	struct buffer_type patch;
+	int shift;
+
+	list = batch_fill_blocks(list);
+
+	if (reference.count)
+		list = follow_reference(list);
+
+	/*
+	for diagnostic purposes, we print out what we've simplified the loader data into
+	*/
+
+	if (options.verbosity >= 1)
+		printf("--- write 0x%02x entry 0x%x\n", settings->hdrsign, settings->entry_point);
+
+	for (current = list; (options.verbosity >= 1) && current; current = current->next)
+	{
+		printf("0x%x 0x%x", current->address, current->length);
+		print_flags(current->flags, current->argument);
+	}
+
+	/*
+	now we write out the new, simplfied loader image
+	*/
+
+	memset(&hdr, 0, sizeof(struct block_header_type));
+
+	hdr.block_code.bcode = settings->bcode;
+	hdr.block_code.flags = BFLAG_IGNORE | BFLAG_FIRST;
+	hdr.block_code.hdrsign = settings->hdrsign;
+	hdr.target_address = settings->entry_point;
+	hdr.argument = 0; /* the size of the application isn't known until alignment padding has been chosen */
+
+	first = handle->length;
+	if (options.format->first_block)
+		write_header(handle, &hdr);
+
+	current = list;
+	previous = NULL;
+	count = 0;
+
+	if (stage2.loader_pending && !stage2.loader_after)
+	{
+		write_fast_loader(handle, settings);
+		count += 2;
+	}
+
+	while (current)
+	{
+		/* keeping a block where the reference has it comes ahead of alignment */
+		shift = reference.count ? reference_padding(handle->length, current) : -1;
+		padding = (shift >= 0) ? (unsigned)shift : choose_padding(handle->length, current);
+		options.size_slack -= padding;
+		if (padding)
+		{
+			write_padding(handle, padding, settings);
+			count++;
+		}
+
+		count++;
+		hdr.block_code.flags = current->flags;
+		hdr.argument = current->argument;
+		hdr.byte_count = current->length;
+		hdr.target_address = current->address;
+
+		write_header(handle, &hdr);
+
+		if (current->data)
+		{
+			/* this is not a Fill Block, so write out the data */
+			buffer_append(handle, current->data, current->length);
+			free(current->data);
+		}
+
+		if (stage2.loader_pending && (current == stage2.loader_after))
+		{
+			write_fast_loader(handle, settings);
+			count += 2;
+		}
+
+		previous = current;
+		current = current->next;
+		free(previous);
+	}
+
+	/* now that the application is complete, the First Block can be told its size */
+	if (options.format->first_block)
+	{
+		hdr.block_code.flags = BFLAG_IGNORE | BFLAG_FIRST;
+		hdr.target_address = settings->entry_point;
+		hdr.argument = handle->length - first;
+		hdr.byte_count = 0;
+
+		memset(&patch, 0, sizeof(patch));
+		write_header(&patch, &hdr);
+		memcpy(handle->data + first, patch.data, patch.length);
+		free(patch.data);
+	}
+
+	return count;
+}
+
+static void append_application(struct application_list_type **applications, struct segment_list_type *segments, struct image_settings_type *settings)
+{
+	struct application_list_type *application;
+
+	while (*applications)
+		applications = &(*applications)->next;
+
+	application = (struct application_list_type *)malloc(sizeof(struct application_list_type));
+	application->settings = *settings;
+	application->segments = segments;
+	application->next = NULL;
+	*applications = application;
+}
+
+static struct segment_list_type *optimize_application(struct segment_list_type *segments)
+{
+	unsigned index;
+
+	/* move each speed-up hook (and what it depends upon) as early in the application as is safe */
+	for (index = 0; index < options.hook_count; index++)
+		segments = hoist_hook(segments, &options.hooks[index]);
+
+	merge_across_inits(segments);
+
+	return segments;
+}
+
+static unsigned write_application(struct buffer_type *handle, struct segment_list_type *segments, struct image_settings_type *settings)
+{
+	struct segment_list_type *previous;
+	struct chunk_list_type *last;
+	unsigned count;
+
+	count = 0;
+
+	while (segments)
+	{
+		if (stage2.loader_pending && !stage2.loader_after)
+		{
+			/* the fast loader loads everything, but the Boot ROM still needs a First Block to find it in */
+			count += write_image(handle, segments->chunks, settings);
+		}
+		else if (stage2.active)
+		{
+			add_stage2(segments->chunks);
+		}
+		else if (segments->chunks)
+		{
+			/* everything after the INIT block that ends stage 1 goes into the stage-2 payload */
+			for (last = segments->chunks; last->next; last = last->next);
+			if (options.stage2_file && (last->flags & BFLAG_INIT) && (last->address == options.split_address))
+				stage2.active = 1;
+
+			count += write_image(handle, segments->chunks, settings);
+		}
+
+		previous = segments;
+		segments = segments->next;
+		free(previous);
+	}
+
+	return count;
+}
+
+static void print_flags(unsigned flags, unsigned argument)
+{
+	if (flags & BFLAG_FILL)
+		fprintf(options.listing, " FILL (0x%x)", argument);
+	if (flags & BFLAG_INIT)
+		fprintf(options.listing, " INIT");
+	fprintf(options.listing, "\n");
+}
+
+static int parse_option(const char *arg)
+{
+	unsigned index, length;
+	const char *value;
+
+	arg += 2; /* skip the leading "--" */
+	value = strchr(arg, '=');
+	if (NULL == value)
+	{
+		/* a bare "--name" is shorthand for "--name=1" */
+		length = strlen(arg);
+		value = "1";
+	}
+	else
+	{
+		length = value - arg;
+		value++;
+	}
+
+	for (index = 0; index < sizeof(option_table) / sizeof(option_table[0]); index++)
+	{
+		if (strlen(option_table[index].name) != length)
+			continue;
+		if (strncmp(option_table[index].name, arg, length))
+			continue;
+
+		if (OPTION_HOOK == option_table[index].kind)
+			return parse_hook(value);
+		else if (OPTION_FOOTPRINT == option_table[index].kind)
+			return parse_init_range(value);
+		else if (OPTION_NUMBER == option_table[index].kind)
+			*(unsigned *)option_table[index].value = strtoul(value, NULL, 0);
+		else
+			*(const char **)option_table[index].value = value;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static unsigned char *load_file(const char *name, unsigned *length)
+{
+	FILE *handle;
+	unsigned char *data;
+	long size;
+
+	handle = fopen(name, "rb");
+	if (NULL == handle)
+		return NULL;
+
+	fseek(handle, 0, SEEK_END);
+	size = ftell(handle);
+	fseek(handle, 0, SEEK_SET);
+
+	/* allocate at least one byte so that an empty file still returns a valid pointer */
+	data = (unsigned char *)malloc(size ? size : 1);
+	*length = fread(data, 1, size, handle);
+	fclose(handle);
+
+	return data;
+}
+
+static int ranges_overlap(unsigned a_address, unsigned a_length, unsigned b_address, unsigned b_length)
+{
+	/* 64-bit arithmetic so that regions ending at the top of the address space do not wrap */
+	if (!a_length || !b_length)
+		return 0;
+	if ((unsigned long long)a_address + a_length <= b_address)
+		return 0;
+	if ((unsigned long long)b_address + b_length <= a_address)
+		return 0;
+	return 1;
+}
+
+/*
+The Boot ROM spends far longer dispatching each FILL block than it does actually filling memory.
+When the user supplies a fill routine (built for their core), the FILL blocks that survive the
+CUSTOMIZE_SMALLEST_FILL_BLOCK check are gathered into a descriptor table, and the routine is
+loaded and called once as an INIT block with the table address as its argument.
+
+table layout (little-endian 32-bit words): count, then count * { address, byte_count, value }
+*/
+
+static int fill_is_batchable(struct chunk_list_type *list, struct chunk_list_type *fill)
+{
+	struct chunk_list_type *other;
+
+	if (fill->flags != BFLAG_FILL)
+		return 0;
+
+	/* a FILL can only be deferred to the end of the segment if nothing else in the segment touches the same memory */
+	for (other = list; other; other = other->next)
+		if ( (other != fill) && ranges_overlap(fill->address, fill->length, other->address, other->length) )
+			return 0;
+
+	return 1;
+}
+
+static struct chunk_list_type *batch_fill_blocks(struct chunk_list_type *list)
+{
+	struct chunk_list_type *current, *previous, *next, *table, *stub, **tail;
+	unsigned count, table_length, *words;
+
+	if (!options.fill_stub)
+		return list;
+
+	count = 0;
+	for (current = list; current; current = current->next)
+		if (fill_is_batchable(list, current))
+			count++;
+
+	if (!count || (count < options.fill_batch_minimum))
+		return list;
+
+	table_length = 4 + 12 * count;
+
+	for (current = list; current; current = current->next)
+	{
+		if (ranges_overlap(current->address, current->length, options.fill_stub_address, options.fill_stub_length) ||
+		    ranges_overlap(current->address, current->length, options.fill_table_address, table_length))
+		{
+			fprintf(stderr, "WARNING: fill stub or table overlaps region 0x%x to 0x%x; not batching\n", current->address, current->address + current->length);
+			return list;
+		}
+	}
+
+	words = (unsigned *)malloc(table_length);
+	words[0] = 0;
+
+	/* move each eligible FILL block's parameters into the table and remove it from the list */
+
+	current = list;
+	previous = NULL;
+
+	while (current)
+	{
+		next = current->next;
+
+		if (fill_is_batchable(list, current))
+		{
+			words[1 + 3 * words[0] + 0] = current->address;
+			words[1 + 3 * words[0] + 1] = current->length;
+			words[1 + 3 * words[0] + 2] = current->argument;
+			words[0]++;
+
+			if (previous)
+				previous->next = next;
+			else
+				list = next;
+			free(current);
+		}
+		else
+		{
+			previous = current;
+		}
+
+		current = next;
+	}
+
+	table = (struct chunk_list_type *)malloc(sizeof(struct chunk_list_type));
+	memset(table, 0, sizeof(struct chunk_list_type));
+	table->address = options.fill_table_address;
+	table->data = (unsigned char *)words;
+	table->length = table_length;
+
+	stub = (struct chunk_list_type *)malloc(sizeof(struct chunk_list_type));
+	memset(stub, 0, sizeof(struct chunk_list_type));
+	stub->address = options.fill_stub_address;
+	stub->argument = options.fill_table_address;
+	stub->flags = BFLAG_INIT;
+	stub->data = (unsigned char *)malloc(options.fill_stub_length);
+	memcpy(stub->data, options.fill_stub, options.fill_stub_length);
+	stub->length = options.fill_stub_length;
+
+	table->next = stub;
+
+	/* the fills must complete before any INIT block (or MMR write) that terminates this segment */
+
+	for (tail = &list; *tail; tail = &(*tail)->next)
+		if ( is_barrier(*tail) && !(*tail)->next )
+			break;
+
+	stub->next = *tail;
+	*tail = table;
+
+	return list;
+}
+
+/*
+--hook=<init_address>,<speedup>[,<start>-<end>]...
+
+<speedup> is the factor by which the boot throughput rises once the INIT routine has run, and each
+<start>-<end> (inclusive) is memory that the routine reads, writes or executes
+*/
+
+static int parse_hook(const char *value)
+{
+	struct hook_type *hook;
+	char *end;
+
+	if (options.hook_count >= MAX_HOOKS)
+		return -1;
+
+	hook = &options.hooks[options.hook_count];
+	memset(hook, 0, sizeof(struct hook_type));
+
+	hook->footprint.address = strtoul(value, &end, 0);
+	if (',' != *end)
+		return -1;
+	hook->speedup = strtod(end + 1, &end);
+	if (hook->speedup <= 0.0)
+		return -1;
+
+	if (parse_footprint(&hook->footprint, end, &end) || *end)
+		return -1;
+
+	options.hook_count++;
+
+	return 0;
+}
+
+/*
+--init-range=<init_address>[,<start>-<end>]...
+
+each <start>-<end> (inclusive) is memory that the INIT routine reads, writes or executes
+*/
+
+static int parse_init_range(const char *value)
+{
+	struct footprint_type *footprint;
+	char *end;
+
+	if (options.footprint_count >= MAX_FOOTPRINTS)
+		return -1;
+
+	footprint = &options.footprints[options.footprint_count];
+	memset(footprint, 0, sizeof(struct footprint_type));
+
+	footprint->address = strtoul(value, &end, 0);
+
+	if (parse_footprint(footprint, end, &end) || *end)
+		return -1;
+
+	options.footprint_count++;
+
+	return 0;
+}
+
+static int parse_footprint(struct footprint_type *footprint, const char *value, char **end)
+{
+	*end = (char *)value;
+
+	while (',' == **end)
+	{
+		if (footprint->range_count >= MAX_FOOTPRINT_RANGES)
+			return -1;
+
+		footprint->ranges[footprint->range_count].address = strtoul(*end + 1, end, 0);
+		if ('-' != **end)
+			return -1;
+		footprint->ranges[footprint->range_count].length = strtoul(*end + 1, end, 0) - footprint->ranges[footprint->range_count].address + 1;
+		footprint->range_count++;
+	}
+
+	return 0;
+}
+
+/*
+profile files are lines of "<name> <value>"; anything following a '#' is a comment
+*/
+
+static int load_profile(const char *name)
+{
+	FILE *handle;
+	char line[256], key[64];
+	double value;
+	unsigned index;
+
+	handle = fopen(name, "r");
+	if (NULL == handle)
+		return -1;
+
+	while (fgets(line, sizeof(line), handle))
+	{
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+
+		if (2 != sscanf(line, "%63s %lf", key, &value))
+			continue;
+
+		for (index = 0; index < sizeof(profile_table) / sizeof(profile_table[0]); index++)
+			if (!strcmp(profile_table[index].name, key))
+				break;
+
+		if (index == sizeof(profile_table) / sizeof(profile_table[0]))
+		{
+			fprintf(stderr, "WARNING: unknown profile setting %s\n", key);
+			continue;
+		}
+
+		*profile_table[index].value = value;
+	}
+
+	fclose(handle);
+
+	return 0;
+}
+
+static void buffer_append(struct buffer_type *buffer, const void *data, unsigned length)
+{
+	if (buffer->length + length > buffer->allocated)
+	{
+		buffer->allocated = 2 * buffer->allocated + length;
+		buffer->data = (unsigned char *)realloc(buffer->data, buffer->allocated);
+	}
+
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+}
+
+static void append_segment(struct segment_list_type **segments, struct chunk_list_type *chunks)
+{
+	struct segment_list_type *segment;
+
+	if (!chunks)
+		return;
+
+	while (*segments)
+		segments = &(*segments)->next;
+
+	segment = (struct segment_list_type *)malloc(sizeof(struct segment_list_type));
+	segment->chunks = chunks;
+	segment->next = NULL;
+	*segments = segment;
+}
+
+/*
+walk a loader stream and total up the time the Boot ROM is predicted to take
+*/
+
+static double estimate_stream(const unsigned char *data, unsigned length, block_visitor visit)
+{
+	struct block_header_type hdr;
+	struct block_cost_type cost;
+	unsigned position, offset, index, header_size;
+	double total, speed, write_ns;
+	int fast_loader, follows_fast_loader, done, final_has_payload;
+	const struct region_type *region;
+	int (*read_format_header)(const unsigned char *data, struct block_header_type *hdr);
+
+	total = 0.0;
+	speed = 1.0;
+	position = 0;
+	fast_loader = 0;
+	done = 0;
+
+	/* the format is fixed for the whole stream, so look it up once rather than for every block */
+	header_size = options.format->header_size;
+	final_has_payload = options.format->final_has_payload;
+	read_format_header = options.format->read_header;
+
+	while (!done && (position + header_size <= length))
+	{
+		/* a header that fails its check ends the stream, as it would for the Boot ROM */
+		if (read_format_header(data + position, &hdr))
+			break;
+		offset = position;
+		memset(&cost, 0, sizeof(cost));
+		if (header_straddles(position))
+			cost.header_us += options.model.page_cross_us / speed;
+		position += header_size;
+
+		follows_fast_loader = fast_loader;
+		fast_loader = 0;
+
+		/* a payload that runs past the end (or a byte count that would wrap position) ends the stream */
+		if ( !(hdr.block_code.flags & (BFLAG_FILL | BFLAG_FIRST)) && ( !(hdr.block_code.flags & BFLAG_FINAL) || final_has_payload ) &&
+		     (hdr.byte_count > length - position) )
+			break;
+
+		cost.header_us += (options.model.header_us + options.model.handshake_us + options.model.host_transfer_us) / speed;
+
+		if ( (hdr.block_code.flags & BFLAG_FINAL) && !final_has_payload )
+		{
+			done = 1;
+		}
+		else if (hdr.block_code.flags & (BFLAG_IGNORE | BFLAG_FIRST))
+		{
+			/* the Boot ROM skips over the payload of an Ignore Block without reading it */
+			if (!(hdr.block_code.flags & BFLAG_FIRST))
+				position += hdr.byte_count;
+			done = hdr.block_code.flags & BFLAG_FINAL;
+
+			/* ...but the fast loader reads the Ignore Block that follows it */
+			if (follows_fast_loader && (hdr.block_code.flags & BFLAG_IGNORE))
+				cost.transfer_us += hdr.byte_count * options.model.byte_ns / 1000.0 / speed / options.model.fastload_speedup;
+		}
+		else
+		{
+			region = find_region(hdr.target_address);
+			write_ns = region ? region->write_ns : 0.0;
+
+			if (hdr.block_code.flags & BFLAG_FILL)
+			{
+				cost.fill_us += hdr.byte_count * (options.model.fill_ns + write_ns) / 1000.0 / speed;
+			}
+			else
+			{
+				cost.transfer_us += hdr.byte_count * (options.model.byte_ns + write_ns) / 1000.0 / speed;
+				cost.transfer_us += host_transfer_count(hdr.byte_count) * options.model.host_transfer_us / speed;
+				if (hdr.byte_count && payload_unaligned(position, hdr.target_address, hdr.byte_count))
+					cost.transfer_us += options.model.unaligned_us / speed;
+				position += hdr.byte_count;
+			}
+
+			if (hdr.block_code.flags & BFLAG_INIT)
+			{
+				cost.init_us += options.model.init_us / speed;
+
+				/* the throughput steps up once a speed-up hook has run */
+				for (index = 0; index < options.hook_count; index++)
+					if (options.hooks[index].footprint.address == hdr.target_address)
+						speed *= options.hooks[index].speedup;
+
+				fast_loader = options.fast_loader && (options.fast_loader_address == hdr.target_address);
+			}
+
+			done = hdr.block_code.flags & BFLAG_FINAL;
+		}
+
+		cost.total_us = cost.header_us + cost.transfer_us + cost.fill_us + cost.init_us;
+
+		if (visit)
+			visit(&hdr, offset, total, &cost);
+
+		total += cost.total_us;
+	}
+
+	return total;
+}
+
+static int overlaps_marked_chunk(struct segment_list_type *start, struct segment_list_type *stop, const struct chunk_list_type *chunk)
+{
+	struct chunk_list_type *other;
+
+	for (; start != stop; start = start->next)
+		for (other = start->chunks; other; other = other->next)
+			if (other->mark && ranges_overlap(chunk->address, chunk->length, other->address, other->length))
+				return 1;
+
+	return 0;
+}
+
+static int chunk_in_footprint(const struct chunk_list_type *chunk, const struct footprint_type *footprint)
+{
+	unsigned index;
+
+	for (index = 0; index < footprint->range_count; index++)
+		if (ranges_overlap(chunk->address, chunk->length, footprint->ranges[index].address, footprint->ranges[index].length))
+			return 1;
+
+	/* the code of the routine itself is always a dependency */
+	if (ranges_overlap(chunk->address, chunk->length, footprint->address, 1))
+		return 1;
+
+	return 0;
+}
+
+/* whether any marked block from start up to (but not including) stop lies in the footprint */
+static int marked_in_footprint(struct segment_list_type *start, struct segment_list_type *stop, const struct footprint_type *footprint)
+{
+	struct chunk_list_type *chunk;
+
+	for (; start != stop; start = start->next)
+		for (chunk = start->chunks; chunk; chunk = chunk->next)
+			if (chunk->mark && chunk_in_footprint(chunk, footprint))
+				return 1;
+
+	return 0;
+}
+
+/*
+A speed-up hook is moved to the front of the application, preceded only by the blocks it depends upon: those
+in its declared memory footprint and any block that overlaps one of them (so their relative order is kept).
+The hook cannot be moved ahead of another INIT block that it depends upon; in that case it follows that INIT.
+Everything that the hook doesn't depend upon, including the bulk of the payload, is deferred until after it.
+*/
+
+static struct segment_list_type *hoist_hook(struct segment_list_type *segments, const struct hook_type *hook)
+{
+	struct segment_list_type *segment, *start, *target, *hoisted, **link;
+	struct chunk_list_type *current, *last, **from, **to;
+	const struct footprint_type *footprint;
+	int changed;
+
+	/* locate the segment terminated by the hook's INIT block */
+
+	for (target = segments; target; target = target->next)
+	{
+		for (last = target->chunks; last && last->next; last = last->next);
+
+		if (last && (last->flags & BFLAG_INIT) && (last->address == hook->footprint.address))
+			break;
+	}
+
+	if (!target)
+		return segments;
+
+	start = segments;
+
+restart:
+	for (segment = start; segment != target->next; segment = segment->next)
+		for (current = segment->chunks; current; current = current->next)
+			current->mark = (current == last);
+
+	/* grow the set of dependent blocks until it stops changing */
+
+	do
+	{
+		changed = 0;
+
+		for (segment = start; segment != target->next; segment = segment->next)
+			for (current = segment->chunks; current; current = current->next)
+			{
+				if (current->mark)
+					continue;
+
+				if (chunk_in_footprint(current, &hook->footprint) || overlaps_marked_chunk(start, target->next, current))
+					current->mark = changed = 1;
+			}
+	} while (changed);
+
+	/*
+	a hook cannot overtake any other INIT block it depends upon, nor any MMR write, nor an INIT block whose declared
+	footprint covers a block that would be moved ahead of it (e.g. data in DDR ahead of the routine that brings DDR up);
+	an INIT block with no declared footprint might touch anything, so it is never overtaken either (as in merge_across_inits)
+	*/
+
+	for (segment = start; segment != target; segment = segment->next)
+	{
+		for (current = segment->chunks; current && current->next; current = current->next);
+
+		if (current && (current->flags & BFLAG_INIT) && !current->mark)
+			footprint = find_footprint(current->address);
+		else
+			footprint = NULL;
+
+		if (current && ( ( (current->flags & BFLAG_INIT) && (current->mark || !footprint || marked_in_footprint(segment->next, target->next, footprint)) ) ||
+		                 (find_region(current->address) && (REGION_MMR == find_region(current->address)->kind)) ))
+		{
+			start = segment->next;
+			goto restart;
+		}
+	}
+
+	/* move the marked blocks (in their original order) into a new segment placed ahead of 'start' */
+
+	hoisted = (struct segment_list_type *)malloc(sizeof(struct segment_list_type));
+	hoisted->chunks = NULL;
+	to = &hoisted->chunks;
+
+	for (segment = start; segment != target->next; segment = segment->next)
+	{
+		from = &segment->chunks;
+
+		while (*from)
+		{
+			current = *from;
+
+			if (current->mark)
+			{
+				*from = current->next;
+				current->next = NULL;
+				*to = current;
+				to = &current->next;
+			}
+			else
+			{
+				from = &current->next;
+			}
+		}
+	}
+
+	for (link = &segments; *link != start; link = &(*link)->next);
+	hoisted->next = start;
+	*link = hoisted;
+
+	/* with its INIT block gone, the rest of the hook's segment is no longer a barrier and joins the next segment */
+
+	if (target->next && target->chunks)
+	{
+		for (current = target->chunks; current->next; current = current->next);
+		current->next = target->next->chunks;
+		target->next->chunks = target->chunks;
+		target->chunks = NULL;
+	}
+
+	return segments;
+}
+
+/*
+the footprint of an INIT routine is either declared with --init-range or as part of a --hook
+*/
+
+static const struct footprint_type *find_footprint(unsigned address)
+{
+	unsigned index;
+
+	for (index = 0; index < options.footprint_count; index++)
+		if (options.footprints[index].address == address)
+			return &options.footprints[index];
+
+	for (index = 0; index < options.hook_count; index++)
+		if (options.hooks[index].footprint.address == address)
+			return &options.hooks[index].footprint;
+
+	return NULL;
+}
+
+static int overlaps_other_chunk(struct segment_list_type *segment, const struct chunk_list_type *chunk)
+{
+	struct chunk_list_type *other;
+
+	for (other = segment->chunks; other; other = other->next)
+		if ( (other != chunk) && ranges_overlap(chunk->address, chunk->length, other->address, other->length) )
+			return 1;
+
+	return 0;
+}
+
+/*
+concatenate two contiguous chunks (low ending where high starts) into 'keep', which must be one of the two
+*/
+
+static void join_chunks(struct chunk_list_type *low, struct chunk_list_type *high, struct chunk_list_type *keep)
+{
+	unsigned char *data;
+
+	data = (unsigned char *)malloc(low->length + high->length);
+	memcpy(data, low->data, low->length);
+	memcpy(data + low->length, high->data, high->length);
+
+	free(low->data);
+	free(high->data);
+	low->data = high->data = NULL;
+
+	keep->address = low->address;
+	keep->length = low->length + high->length;
+	keep->data = data;
+}
+
+/*
+An INIT block is normally a barrier: the blocks on either side of it can't be merged.  However, when the memory
+footprint of the INIT routine is known, a block that is outside of the footprint (and overlaps nothing else on the
+way) can cross the barrier to join a contiguous block on the other side.  A block may cross several such barriers.
+*/
+
+static void merge_across_inits(struct segment_list_type *segments)
+{
+	struct segment_list_type **table, *segment;
+	struct chunk_list_type *init, *low, *high, **link;
+	const struct footprint_type *footprint;
+	unsigned count, index, scan;
+	int changed;
+
+	for (count = 0, segment = segments; segment; segment = segment->next)
+		count++;
+
+	if (count < 2)
+		return;
+
+	table = (struct segment_list_type **)malloc(count * sizeof(struct segment_list_type *));
+	for (index = 0, segment = segments; segment; segment = segment->next)
+		table[index++] = segment;
+
+	do
+	{
+		changed = 0;
+
+		for (index = 1; index < count; index++)
+		{
+			link = &table[index]->chunks;
+
+			while (*link)
+			{
+				high = *link;
+				low = NULL;
+
+				if (!high->flags && high->data && !overlaps_other_chunk(table[index], high))
+				{
+					/* walk back across each barrier that this block can safely cross */
+
+					for (scan = index; scan-- > 0;)
+					{
+						for (init = table[scan]->chunks; init && init->next; init = init->next);
+
+						if (!init || !(init->flags & BFLAG_INIT))
+							break;
+
+						footprint = find_footprint(init->address);
+						if (!footprint || chunk_in_footprint(high, footprint) || overlaps_other_chunk(table[scan], high))
+							break;
+
+						for (low = table[scan]->chunks; low; low = low->next)
+							if (!low->flags && low->data && !overlaps_other_chunk(table[scan], low) && same_region(low->address, low->length, high->address, high->length))
+								if ( (low->address + low->length == high->address) || (high->address + high->length == low->address) )
+									break;
+
+						if (low)
+							break;
+					}
+				}
+
+				if (!low)
+				{
+					link = &high->next;
+					continue;
+				}
+
+				if (low->address + low->length == high->address)
+					join_chunks(low, high, low);
+				else
+					join_chunks(high, low, low);
+
+				*link = high->next;
+				free(high);
+				changed = 1;
+			}
+		}
+
+		/* blocks that can't move earlier may instead be deferred to join a contiguous block after the barrier */
+
+		for (index = 0; index + 1 < count; index++)
+		{
+			for (init = table[index]->chunks; init && init->next; init = init->next);
+
+			if (!init || !(init->flags & BFLAG_INIT))
+				continue;
+
+			footprint = find_footprint(init->address);
+			if (!footprint)
+				continue;
+
+			link = &table[index]->chunks;
+
+			while (*link)
+			{
+				low = *link;
+				high = NULL;
+
+				if (!low->flags && low->data && !chunk_in_footprint(low, footprint) && !overlaps_other_chunk(table[index], low) && !overlaps_other_chunk(table[index + 1], low))
+				{
+					for (high = table[index + 1]->chunks; high; high = high->next)
+						if (!high->flags && high->data && !overlaps_other_chunk(table[index + 1], high) && same_region(low->address, low->length, high->address, high->length))
+							if ( (low->address + low->length == high->address) || (high->address + high->length == low->address) )
+								break;
+				}
+
+				if (!high)
+				{
+					link = &low->next;
+					continue;
+				}
+
+				if (low->address + low->length == high->address)
+					join_chunks(low, high, high);
+				else
+					join_chunks(high, low, high);
+
+				*link = low->next;
+				free(low);
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	free(table);
+}
+
+static void add_stage2(struct chunk_list_type *list)
+{
+	struct chunk_list_type *previous;
+	unsigned entry[5];
+	static const unsigned char padding[3];
+
+	while (list)
+	{
+		entry[0] = list->address;
+		entry[1] = list->length;
+		entry[2] = list->argument;
+		entry[3] = list->flags;
+		entry[4] = stage2.payload.length; /* relative to the payload for now; fixed up by write_stage2() */
+
+		buffer_append(&stage2.table, entry, sizeof(entry));
+		stage2.count++;
+
+		if (list->data)
+		{
+			buffer_append(&stage2.payload, list->data, list->length);
+			buffer_append(&stage2.payload, padding, (4 - (list->length & 3)) & 3);
+			free(list->data);
+		}
+
+		previous = list;
+		list = list->next;
+		free(previous);
+	}
+}
+
+static void finish_stage2(struct buffer_type *stage, unsigned entry_point)
+{
+	unsigned header[4], index, base;
+
+	header[0] = STAGE2_MAGIC;
+	header[1] = STAGE2_VERSION;
+	header[2] = entry_point;
+	header[3] = stage2.count;
+
+	/* payload offsets become offsets from the start of the header */
+	base = sizeof(header) + stage2.table.length;
+	for (index = 0; index < stage2.count; index++)
+		((unsigned *)stage2.table.data)[5 * index + 4] += base;
+
+	buffer_append(stage, header, sizeof(header));
+	buffer_append(stage, stage2.table.data, stage2.table.length);
+	buffer_append(stage, stage2.payload.data, stage2.payload.length);
+
+	if (options.verbosity >= 1)
+		printf("%u blocks (%u bytes) written to stage 2\n", stage2.count, stage->length);
+}
+
+static int write_stage2(const char *name, unsigned entry_point)
+{
+	FILE *handle;
+	struct buffer_type stage;
+
+	handle = fopen(name, "wb");
+	if (NULL == handle)
+		return -1;
+
+	memset(&stage, 0, sizeof(stage));
+	finish_stage2(&stage, entry_point);
+
+	fwrite(stage.data, 1, stage.length, handle);
+	fclose(handle);
+	free(stage.data);
+
+	return 0;
+}
+
+/*
+The fast loader is loaded and called as an INIT block.  Its argument is the offset (from the start of the
+loader stream) of an Ignore Block payload that the Boot ROM itself skips over:
+
+  config word count, config words { flash lanes, clock divider, read command, dummy cycles }, stage-2 payload
+
+The routine reconfigures the boot flash and then loads the stage-2 payload (see above) itself.
+*/
+
+static void write_fast_loader(struct buffer_type *handle, struct image_settings_type *settings)
+{
+	struct block_header_type hdr;
+	struct buffer_type stage;
+	unsigned config[5];
+
+	memset(&stage, 0, sizeof(stage));
+
+	config[0] = 4;
+	config[1] = (unsigned)options.board.flash_lanes;
+	config[2] = (unsigned)options.board.flash_clock_div;
+	config[3] = (unsigned)options.board.flash_read_command;
+	config[4] = (unsigned)options.board.flash_dummy_cycles;
+	buffer_append(&stage, config, sizeof(config));
+
+	finish_stage2(&stage, settings->entry_point);
+
+	memset(&hdr, 0, sizeof(struct block_header_type));
+	hdr.block_code.bcode = settings->bcode;
+	hdr.block_code.hdrsign = settings->hdrsign;
+
+	hdr.block_code.flags = BFLAG_INIT;
+	hdr.target_address = options.fast_loader_address;
+	hdr.byte_count = options.fast_loader_length;
+	hdr.argument = handle->length + 2 * options.format->header_size + options.fast_loader_length;
+	write_header(handle, &hdr);
+	buffer_append(handle, options.fast_loader, options.fast_loader_length);
+
+	hdr.block_code.flags = BFLAG_IGNORE;
+	hdr.target_address = 0;
+	hdr.byte_count = stage.length;
+	hdr.argument = 0;
+	write_header(handle, &hdr);
+	buffer_append(handle, stage.data, stage.length);
+
+	free(stage.data);
+	stage2.loader_pending = 0;
+}
+
+/*
+The fast loader carries the stage-2 payload in its Ignore Block, so that payload has to be complete before the
+loader is written early in the first application.  Everything after the split point (or everything, without
+--split) is moved into it up front, and the split INIT block is remembered as where the loader goes.
+*/
+
+static void collect_fast_load(struct application_list_type *applications)
+{
+	struct segment_list_type *segment;
+	struct chunk_list_type *last;
+	int passed;
+
+	passed = !options.split;
+	stage2.loader_pending = 1;
+	stage2.loader_after = NULL;
+
+	for (; applications; applications = applications->next)
+		for (segment = applications->segments; segment; segment = segment->next)
+		{
+			if (passed)
+			{
+				add_stage2(segment->chunks);
+				segment->chunks = NULL;
+			}
+			else if (segment->chunks)
+			{
+				for (last = segment->chunks; last->next; last = last->next);
+				if ((last->flags & BFLAG_INIT) && (last->address == options.split_address))
+				{
+					stage2.loader_after = last;
+					passed = 1;
+				}
+			}
+		}
+
+	if (!passed)
+		fprintf(stderr, "WARNING: no INIT block at 0x%x; the fast loader has nothing to load\n", options.split_address);
+}
+
+/*
+memory map files are lines of "<start> <end> <name> <kind> [<write_ns>]", where <end> is inclusive and <kind>
+is one of L1, L2, DDR, MMR, FLASH or OTHER; anything following a '#' is a comment
+*/
+
+static int load_memory_map(const char *name)
+{
+	static const char *kinds[] = { "L1", "L2", "DDR", "MMR", "FLASH", "OTHER" };
+	static char names[MAX_REGIONS][32];
+	FILE *handle;
+	char line[256], kind[16], start[24], end[24];
+	struct region_type *region;
+	unsigned index;
+	int fields;
+
+	handle = fopen(name, "r");
+	if (NULL == handle)
+		return -1;
+
+	options.regions = options.loaded_regions;
+	options.region_count = 0;
+
+	while (fgets(line, sizeof(line), handle))
+	{
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+
+		if (options.region_count >= MAX_REGIONS)
+			break;
+
+		region = &options.loaded_regions[options.region_count];
+		region->write_ns = 0.0;
+
+		fields = sscanf(line, "%23s %23s %31s %15s %lf", start, end, names[options.region_count], kind, &region->write_ns);
+		if (fields < 4)
+			continue;
+
+		region->start = strtoul(start, NULL, 0);
+		region->end = strtoul(end, NULL, 0);
+
+		for (index = 0; index < sizeof(kinds) / sizeof(kinds[0]); index++)
+			if (!strcmp(kinds[index], kind))
+				break;
+
+		if (index == sizeof(kinds) / sizeof(kinds[0]))
+		{
+			fprintf(stderr, "WARNING: unknown region kind %s\n", kind);
+			index = REGION_OTHER;
+		}
+
+		region->name = names[options.region_count];
+		region->kind = (enum region_kind)index;
+		options.region_count++;
+	}
+
+	fclose(handle);
+
+	return 0;
+}
+
+static const struct region_type *find_region(unsigned address)
+{
+	unsigned index;
+
+	for (index = 0; index < options.region_count; index++)
+		if ( (address >= options.regions[index].start) && (address <= options.regions[index].end) )
+			return &options.regions[index];
+
+	return NULL;
+}
+
+/*
+whether two ranges may be joined into one block: both must lie within the same region, and MMR writes are never joined
+*/
+
+static int same_region(unsigned address, unsigned length, unsigned other_address, unsigned other_length)
+{
+	const struct region_type *region;
+
+	region = find_region(address);
+
+	if (region && (REGION_MMR == region->kind))
+		return 0;
+	if (region != find_region(length ? address + length - 1 : address))
+		return 0;
+	if (region != find_region(other_address))
+		return 0;
+	if (region != find_region(other_length ? other_address + other_length - 1 : other_address))
+		return 0;
+
+	return 1;
+}
+
+/*
+whether a range lies wholly within one L1, L2 or DDR region of the memory map; with no map, nothing is known to be RAM
+*/
+
+static int in_ram_region(unsigned address, unsigned length)
+{
+	const struct region_type *region;
+
+	region = find_region(address);
+
+	if (!region || ( (REGION_L1 != region->kind) && (REGION_L2 != region->kind) && (REGION_DDR != region->kind) ))
+		return 0;
+
+	return (unsigned long long)address + length - 1 <= region->end;
+}
+
+static int is_barrier(const struct chunk_list_type *chunk)
+{
+	const struct region_type *region;
+
+	if (chunk->flags & BFLAG_INIT)
+		return 1;
+
+	region = find_region(chunk->address);
+
+	return region && (REGION_MMR == region->kind);
+}
+
+/*
+Besides binary, elfloader can produce ASCII (one hex word per line), include (comma-separated hex words) and
+Intel hex loader files.  Text input is converted to the binary loader stream before it is parsed.
+*/
+
+static signed char hex_value[256];
+
+/* a binary loader stream always has non-text bytes (e.g. the 0xAD header signature) */
+static int is_text(const unsigned char *data, unsigned length)
+{
+	unsigned index;
+
+	for (index = 0; index < length; index++)
+		if ( (data[index] < ' ') && !strchr("\t\r\n\f", data[index]) )
+			return 0;
+		else if (data[index] > '~')
+			return 0;
+
+	return 1;
+}
+
+static unsigned char *decode_input(unsigned char *raw, unsigned *length)
+{
+	unsigned char *text, *data;
+	unsigned index;
+
+	for (index = 0; index < 256; index++)
+		hex_value[index] = -1;
+	for (index = 0; index < 10; index++)
+		hex_value['0' + index] = index;
+	for (index = 0; index < 6; index++)
+		hex_value['a' + index] = hex_value['A' + index] = 10 + index;
+
+	if (!strcmp(options.input_format, "binary"))
+		return raw;
+
+	if (!strcmp(options.input_format, "auto"))
+	{
+		if (!is_text(raw, *length))
+			return raw;
+	}
+	else if (strcmp(options.input_format, "ascii") && strcmp(options.input_format, "include") && strcmp(options.input_format, "ihex"))
+	{
+		return NULL;
+	}
+
+	/* NUL-terminate the text so that the decoders don't need to keep checking the length */
+	text = (unsigned char *)malloc(*length + 1);
+	memcpy(text, raw, *length);
+	text[*length] = '\0';
+	free(raw);
+
+	for (index = 0; strchr(" \t\r\n", text[index]) && text[index]; index++);
+
+	if (!strcmp(options.input_format, "ihex") || ( !strcmp(options.input_format, "auto") && (':' == text[index]) ))
+		data = decode_ihex(text, length);
+	else
+		data = decode_text(text, length);
+
+	free(text);
+
+	return data;
+}
+
+/*
+each hex number (with or without 0x) contributes 1, 2 or 4 little-endian bytes depending on its number of digits;
+C comments, identifiers and [...] declarators are skipped, and anything ahead of an initializer's '=' or '{' is
+discarded (only the braces' contents are data), so include files and C arrays can be read.  Text with commas or braces
+is C, where a number without 0x is decimal (or octal, with a leading 0) as the compiler would read it; its width can
+only come from the element type of the declaration (char, short, int, long or their intN_t forms), so without one
+it is rejected rather than guessed at.  A declared element type sets the width of every element.
+*/
+
+static unsigned char *decode_text(const unsigned char *text, unsigned *length)
+{
+	struct buffer_type data;
+	const unsigned char *start;
+	unsigned digits, size, depth, base, element_size, c_syntax;
+	unsigned long long value;
+
+	memset(&data, 0, sizeof(data));
+	depth = 0;
+	element_size = 0;
+	c_syntax = strchr((const char *)text, ',') || strchr((const char *)text, '{');
+
+	while (*text)
+	{
+		if ('[' == *text)
+		{
+			while (*text && (']' != *text))
+				text++;
+			continue;
+		}
+
+		if ( ( ('=' == *text) || ('{' == *text) ) && !depth )
+			data.length = 0; /* what came before was the declaration */
+
+		if ('{' == *text)
+			depth++;
+
+		if ( ('}' == *text) && depth && !--depth )
+			break;
+
+		if ( ('/' == text[0]) && ('*' == text[1]) )
+		{
+			for (text += 2; *text && !( ('*' == text[0]) && ('/' == text[1]) ); text++);
+			if (*text)
+				text += 2;
+			continue;
+		}
+
+		if ( ( ('/' == text[0]) && ('/' == text[1]) ) || ('#' == text[0]) )
+		{
+			while (*text && ('\n' != *text))
+				text++;
+			continue;
+		}
+
+		if (!isalnum(*text) && ('_' != *text))
+		{
+			text++;
+			continue;
+		}
+
+		start = text;
+		base = 16;
+		if ( ('0' == text[0]) && ( ('x' == text[1]) || ('X' == text[1]) ) )
+			text += 2;
+		else if (c_syntax)
+			base = ('0' == text[0]) ? 8 : 10;
+
+		value = digits = 0;
+		while ( (hex_value[*text] >= 0) && (hex_value[*text] < (int)base) )
+		{
+			/* past 32 bits, the value is too wide whatever follows; stop there so it cannot wrap */
+			if (value <= 0xFFFFFFFFULL)
+				value = value * base + hex_value[*text];
+			text++;
+			digits++;
+		}
+
+		/* integer suffixes (10u, 0xFFUL) */
+		while ( c_syntax && digits && *text && strchr("uUlL", *text) )
+			text++;
+
+		if ( isalnum(*text) || ('_' == *text) || !digits )
+		{
+			/* an identifier; in a declaration, the element type tells the width of each number */
+			text = start;
+			while (isalnum(*text) || ('_' == *text))
+				text++;
+
+			if (!depth)
+			{
+				if ( ((text - start == 4) && !strncmp((const char *)start, "char", 4)) || ( (text - start >= 6) && !strncmp((const char *)text - 6, "int8_t", 6) ) )
+					element_size = 1;
+				else if ( ((text - start == 5) && !strncmp((const char *)start, "short", 5)) || ( (text - start >= 7) && !strncmp((const char *)text - 7, "int16_t", 7) ) )
+					element_size = 2;
+				else if ( ( ((text - start == 3) && !strncmp((const char *)start, "int", 3)) || ((text - start == 4) && !strncmp((const char *)start, "long", 4)) ) &&
+				          (element_size < 2) )
+					element_size = 4; /* "short int" stays short */
+				else if ((text - start >= 7) && !strncmp((const char *)text - 7, "int32_t", 7))
+					element_size = 4;
+			}
+			continue;
+		}
+
+		/* elfloader's hex words take their width from their digits; C takes it from the declaration */
+		if ( (16 == base) && !element_size )
+			size = (digits <= 2) ? 1 : (digits <= 4) ? 2 : (digits <= 8) ? 4 : 0;
+		else
+			size = element_size;
+
+		if ( !size || (value >> (8 * size)) )
+		{
+			free(data.data);
+			return NULL;
+		}
+
+		buffer_append(&data, &value, size);
+	}
+
+	*length = data.length;
+
+	/* the caller frees the result, so never return NULL for an empty file */
+	return data.data ? data.data : (unsigned char *)calloc(1, 1);
+}
+
+static unsigned char *decode_ihex(const unsigned char *text, unsigned *length)
+{
+	unsigned char record[256 + 5], *data;
+	unsigned count, index, address, upper, lowest, highest, checksum;
+	struct { unsigned address, length; unsigned char bytes[255]; } *records;
+	unsigned record_count, record_allocated;
+
+	records = NULL;
+	record_count = record_allocated = 0;
+	upper = 0;
+	lowest = 0xFFFFFFFF;
+	highest = 0;
+
+	while (*text)
+	{
+		if (':' != *text++)
+			continue;
+
+		for (count = 0; (hex_value[text[0]] >= 0) && (hex_value[text[1]] >= 0) && (count < sizeof(record)); count++, text += 2)
+			record[count] = (hex_value[text[0]] << 4) | hex_value[text[1]];
+
+		if ( (count < 5) || (count != 5U + record[0]) )
+			goto fail;
+
+		for (checksum = index = 0; index < count; index++)
+			checksum += record[index];
+		if (checksum & 0xFF)
+			goto fail;
+
+		address = (record[1] << 8) | record[2];
+
+		if (0x00 == record[3])
+		{
+			if (record_count == record_allocated)
+			{
+				record_allocated = 2 * record_allocated + 64;
+				records = realloc(records, record_allocated * sizeof(*records));
+			}
+
+			records[record_count].address = upper + address;
+			records[record_count].length = record[0];
+			memcpy(records[record_count].bytes, record + 4, record[0]);
+
+			if (record[0])
+			{
+				if (upper + address < lowest)
+					lowest = upper + address;
+				if (upper + address + record[0] > highest)
+					highest = upper + address + record[0];
+			}
+
+			record_count++;
+		}
+		else if (0x01 == record[3])
+		{
+			break;
+		}
+		else if ( (0x02 == record[3]) && (2 == record[0]) )
+		{
+			upper = ((record[4] << 8) | record[5]) << 4;
+		}
+		else if ( (0x04 == record[3]) && (2 == record[0]) )
+		{
+			upper = ((record[4] << 8) | record[5]) << 16;
+		}
+	}
+
+	/* the loader stream is the contiguous image from the lowest address; unused gaps read as erased flash */
+	if (lowest > highest)
+		lowest = highest = 0;
+
+	data = (unsigned char *)malloc(highest - lowest + 1);
+	memset(data, 0xFF, highest - lowest);
+
+	for (index = 0; index < record_count; index++)
+		memcpy(data + records[index].address - lowest, records[index].bytes, records[index].length);
+
+	free(records);
+	*length = highest - lowest;
+
+	return data;
+
+fail:
+	free(records);
+	return NULL;
+}
+
+static int encode_output(FILE *handle, const unsigned char *data, unsigned length)
+{
+	unsigned index, word, count, address, upper, checksum, column;
+
+	if (!strcmp(options.output_format, "binary"))
+	{
+		fwrite(data, 1, length, handle);
+	}
+	else if ( !strcmp(options.output_format, "ascii") || !strcmp(options.output_format, "include") )
+	{
+		/* one little-endian 32-bit word per line, as elfloader does; a ragged tail is padded with zeros */
+		for (index = 0; index < length; index += 4)
+		{
+			word = 0;
+			memcpy(&word, data + index, (length - index < 4) ? length - index : 4);
+
+			if (!strcmp(options.output_format, "ascii"))
+				fprintf(handle, "%08X\n", word);
+			else
+				fprintf(handle, "0x%08X,\n", word);
+		}
+	}
+	else if (!strcmp(options.output_format, "carray"))
+	{
+		fprintf(handle, "/* %u bytes */\n", length);
+		fprintf(handle, "const unsigned char ldr_image[] =\n{\n");
+
+		for (index = column = 0; index < length; index++)
+		{
+			fprintf(handle, "%s0x%02X,", column ? " " : "\t", data[index]);
+			if (16 == ++column)
+			{
+				fprintf(handle, "\n");
+				column = 0;
+			}
+		}
+
+		fprintf(handle, "%s};\n", column ? "\n" : "");
+	}
+	else if (!strcmp(options.output_format, "ihex"))
+	{
+		upper = 0xFFFFFFFF;
+
+		for (index = 0; index < length; index += count)
+		{
+			address = options.ihex_base + index;
+			count = (length - index < 16) ? length - index : 16;
+
+			/* don't let a record straddle a 64 KiB boundary */
+			if ( ((address & 0xFFFF) + count) > 0x10000 )
+				count = 0x10000 - (address & 0xFFFF);
+
+			if ((address >> 16) != upper)
+			{
+				upper = address >> 16;
+				checksum = 2 + 4 + (upper >> 8) + (upper & 0xFF);
+				fprintf(handle, ":02000004%04X%02X\n", upper, (0x100 - (checksum & 0xFF)) & 0xFF);
+			}
+
+			fprintf(handle, ":%02X%04X00", count, address & 0xFFFF);
+			checksum = count + ((address >> 8) & 0xFF) + (address & 0xFF);
+
+			for (word = 0; word < count; word++)
+			{
+				fprintf(handle, "%02X", data[index + word]);
+				checksum += data[index + word];
+			}
+
+			fprintf(handle, "%02X\n", (0x100 - (checksum & 0xFF)) & 0xFF);
+		}
+
+		fprintf(handle, ":00000001FF\n");
+	}
+	else
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+In a host-driven (slave) boot, the host pushes the stream: each header is one transfer, and each payload is one
+or more transfers no bigger than the host's DMA limit.  The host must wait for the processor to be ready
+(HWAIT) before pushing each header and before the start of each payload.
+*/
+
+static unsigned host_transfer_count(unsigned length)
+{
+	unsigned dma_max;
+
+	dma_max = (options.model.host_dma_max >= 1.0) ? (unsigned)options.model.host_dma_max : 1;
+
+	return (length + dma_max - 1) / dma_max;
+}
+
+static int write_host_table(const char *name, const unsigned char *data, unsigned length)
+{
+	FILE *handle;
+	struct block_header_type hdr;
+	unsigned position, payload, remaining, count, dma_max;
+
+	handle = fopen(name, "w");
+	if (NULL == handle)
+		return -1;
+
+	dma_max = (options.model.host_dma_max >= 1.0) ? (unsigned)options.model.host_dma_max : 1;
+
+	fprintf(handle, "/* host-side transfer table generated by ldrshrink: { stream offset, length, wait for ready before pushing } */\n");
+	fprintf(handle, "static const unsigned ldr_transfers[][3] =\n{\n");
+
+	position = count = 0;
+
+	while (position + options.format->header_size <= length)
+	{
+		read_header(data + position, &hdr);
+
+		fprintf(handle, "\t{ 0x%08x, %u, 1 },\n", position, options.format->header_size);
+		position += options.format->header_size;
+		count++;
+
+		/* only these blocks have a payload in the stream */
+		payload = 0;
+		if ( !(hdr.block_code.flags & (BFLAG_FILL | BFLAG_FIRST)) && ( !(hdr.block_code.flags & BFLAG_FINAL) || options.format->final_has_payload ) )
+			payload = hdr.byte_count;
+
+		for (remaining = payload; remaining; )
+		{
+			fprintf(handle, "\t{ 0x%08x, %u, %u },\n", position, (remaining < dma_max) ? remaining : dma_max, (remaining == payload) ? 1 : 0);
+			position += (remaining < dma_max) ? remaining : dma_max;
+			remaining -= (remaining < dma_max) ? remaining : dma_max;
+			count++;
+		}
+
+		if (hdr.block_code.flags & BFLAG_FINAL)
+			break;
+	}
+
+	fprintf(handle, "};\n\n#define LDR_TRANSFER_COUNT %u\n", count);
+	fclose(handle);
+
+	return 0;
+}
+
+/*
+Within a segment, neighbouring blocks (in address order) can be merged into one, saving a block header:
+ - data blocks that are contiguous: always worthwhile
+ - data blocks separated by an unused gap (up to --bridge bytes) in RAM of the memory map: the gap is filled with zeros
+ - a FILL block contiguous with data: the FILL is unrolled (the 2018 CUSTOMIZE_SMALLEST_FILL_BLOCK change)
+Each costs image size and saves boot time.  With --max-size, the transformations with the best time saved per
+byte are chosen (greedily, as in a fractional knapsack) until the budget is used up.  The size estimate includes
+the fill stub and its table, the fast loader and the stage-2 payload that it carries (the --stage2 file costs
+the image nothing); whatever the transformations leave of the budget is all that alignment and reference padding
+may then use.  --pareto only reports: without --max-size, it changes nothing that would not otherwise change.
+*/
+
+static void plan_size_budget(struct application_list_type *applications)
+{
+	struct application_list_type *application;
+	struct segment_list_type *segment;
+	struct plan_type *plans, *plan, **link;
+	struct candidate_type *candidates, *candidate;
+	struct chunk_list_type *left, *right, *fill, *current;
+	unsigned count, allocated, index, first, last, gap, size, header, batched;
+	double header_cost, saved;
+	long long budget;
+	int passed, apply;
+
+	header_cost = options.model.header_us + options.model.handshake_us + options.model.host_transfer_us;
+
+	if (options.bridge_max && !options.region_count)
+		fprintf(stderr, "WARNING: --bridge only fills gaps within RAM of a memory map (--family or --memory-map); no gap is bridged\n");
+
+	/* build a plan for each segment, and estimate the size of the image without any of the transformations */
+
+	plans = NULL;
+	link = &plans;
+	header = options.format->header_size;
+	size = header; /* Final Block */
+	passed = 0;
+
+	if (options.fast_loader)
+	{
+		/* its INIT and Ignore Blocks, the config words and the stage-2 header */
+		size += 2 * header + options.fast_loader_length + 5 * 4 + 4 * 4;
+
+		/* without a split point, an otherwise empty First Block holds it */
+		if (!options.split)
+		{
+			passed = 1;
+			if (options.format->first_block)
+				size += header;
+		}
+	}
+
+	for (application = applications; application; application = application->next)
+		for (segment = application->segments; segment; segment = segment->next)
+		{
+			if (!segment->chunks)
+				continue;
+
+			*link = plan = make_plan(segment);
+			link = &plan->next;
+
+			if (passed)
+			{
+				/* in the stage-2 payload: each block is a table entry and its data padded to a word */
+				plan->staged = (NULL != options.stage2_file);
+				if (options.fast_loader)
+					for (index = 0; index < plan->count; index++)
+						size += 5 * 4 + (plan->sorted[index]->data ? (plan->sorted[index]->length + 3) & ~3 : 0);
+				continue;
+			}
+
+			batched = 0;
+			if (options.fill_stub)
+				for (current = segment->chunks; current; current = current->next)
+					batched += fill_is_batchable(segment->chunks, current);
+			plan->batched = batched && (batched >= options.fill_batch_minimum);
+
+			if (options.format->first_block)
+				size += header;
+			for (index = 0; index < plan->count; index++)
+				size += header + (plan->sorted[index]->data ? plan->sorted[index]->length : 0);
+
+			/* the table entry replaces each batched FILL block; the table and stub each add a block */
+			if (plan->batched)
+				size += 2 * header + 4 + options.fill_stub_length + batched * 12 - batched * header;
+
+			for (current = segment->chunks; current->next; current = current->next);
+			if ( options.split && (options.stage2_file || options.fast_loader) && (current->flags & BFLAG_INIT) && (current->address == options.split_address) )
+				passed = 1;
+		}
+
+	/* list the candidate transformations */
+
+	candidates = NULL;
+	count = allocated = 0;
+
+	for (plan = plans; plan; plan = plan->next)
+		for (index = 0; index + 1 < plan->count; index++)
+		{
+			left = plan->sorted[index];
+			right = plan->sorted[index + 1];
+
+			if (count + 2 > allocated)
+			{
+				allocated = 2 * allocated + 64;
+				candidates = (struct candidate_type *)realloc(candidates, allocated * sizeof(struct candidate_type));
+			}
+
+			candidate = &candidates[count];
+			candidate->plan = plan;
+
+			if (!joinable_chunk(plan->segment, left) || !joinable_chunk(plan->segment, right))
+				continue;
+			if (!same_region(left->address, left->length, right->address, right->length))
+				continue;
+			if (left->address + left->length > right->address)
+				continue;
+
+			gap = right->address - (left->address + left->length);
+
+			if (!left->flags && !right->flags)
+			{
+				/* data followed by data, possibly with a gap to bridge */
+				if (gap && ( (gap > options.bridge_max) || !in_ram_region(left->address + left->length, gap) || !gap_is_unused(plans, left->address + left->length, gap) ))
+					continue;
+
+				candidate->first = candidate->last = index;
+				candidate->unrolls_fill = 0;
+				candidate->delta_bytes = (int)gap - (int)options.format->header_size;
+				candidate->delta_us = -header_cost + gap * options.model.byte_ns / 1000.0;
+				count++;
+			}
+			else if (!gap && !left->flags && (right->flags == BFLAG_FILL))
+			{
+				/* a FILL block that follows data; it may also be followed by contiguous data */
+				fill = right;
+				first = last = index;
+				if ( (index + 2 < plan->count) && !plan->sorted[index + 2]->flags && joinable_chunk(plan->segment, plan->sorted[index + 2]) &&
+				     (fill->address + fill->length == plan->sorted[index + 2]->address) && same_region(fill->address, fill->length, plan->sorted[index + 2]->address, plan->sorted[index + 2]->length) )
+					last = index + 1;
+
+				candidate->first = first;
+				candidate->last = last;
+				candidate->unrolls_fill = 1;
+				candidate->delta_bytes = (int)fill->length - (int)((last - first + 1) * options.format->header_size);
+				if (plan->batched && fill_is_batchable(plan->segment->chunks, fill))
+					candidate->delta_bytes += (int)options.format->header_size - 12;
+				candidate->delta_us = -(double)(last - first + 1) * header_cost + fill->length * (options.model.byte_ns - options.model.fill_ns) / 1000.0;
+				count++;
+			}
+			else if (!gap && (left->flags == BFLAG_FILL) && !right->flags)
+			{
+				/* a FILL block followed by data; when data also precedes it, it was handled above */
+				if (index && !plan->sorted[index - 1]->flags && (plan->sorted[index - 1]->address + plan->sorted[index - 1]->length == left->address) &&
+				    joinable_chunk(plan->segment, plan->sorted[index - 1]) && same_region(plan->sorted[index - 1]->address, plan->sorted[index - 1]->length, left->address, left->length))
+					continue;
+
+				candidate->first = candidate->last = index;
+				candidate->unrolls_fill = 1;
+				candidate->delta_bytes = (int)left->length - (int)options.format->header_size;
+				if (plan->batched && fill_is_batchable(plan->segment->chunks, left))
+					candidate->delta_bytes += (int)options.format->header_size - 12;
+				candidate->delta_us = -header_cost + left->length * (options.model.byte_ns - options.model.fill_ns) / 1000.0;
+				count++;
+			}
+		}
+
+	/* take the transformations with the best ratio first; those that save both size and time always come first */
+
+	qsort(candidates, count, sizeof(struct candidate_type), compare_candidate);
+
+	budget = options.max_size ? (long long)options.max_size : (long long)0x7FFFFFFF;
+	saved = 0.0;
+
+	if (options.pareto)
+		fprintf(options.listing, "--- size/boot-time trade-off\n%u bytes; %.0f us saved\n", size, saved);
+
+	for (index = 0; index < count; index++)
+	{
+		candidate = &candidates[index];
+
+		if (candidate->plan->staged)
+			candidate->delta_bytes = 0;
+
+		if (candidate->delta_us >= 0.0)
+			continue; /* never worthwhile */
+
+		if ( (candidate->delta_bytes > 0) && ((long long)size + candidate->delta_bytes > budget) )
+		{
+			if (options.pareto)
+				fprintf(options.listing, "%u bytes; %.0f us saved (beyond budget)\n", size + candidate->delta_bytes, saved - candidate->delta_us);
+			continue;
+		}
+
+		/* without a budget, only --bridge was asked for, so FILL blocks are left as they were parsed */
+		apply = options.max_size || (options.bridge_max && !candidate->unrolls_fill);
+		if (!apply && !options.pareto)
+			continue;
+
+		size += candidate->delta_bytes;
+		saved -= candidate->delta_us;
+
+		for (first = candidate->first; apply && (first <= candidate->last); first++)
+			candidate->plan->join[first] = 1;
+
+		if (options.pareto)
+			fprintf(options.listing, "%u bytes; %.0f us saved%s\n", size, saved, apply ? "" : " (not applied)");
+	}
+
+	if (options.max_size)
+		options.size_slack = (budget > (long long)size) ? (unsigned)(budget - size) : 0;
+
+	free(candidates);
+
+	while (plans)
+	{
+		plan = plans;
+		plans = plans->next;
+		apply_plan(plan);
+		free(plan->sorted);
+		free(plan->join);
+		free(plan);
+	}
+}
+
+static struct plan_type *make_plan(struct segment_list_type *segment)
+{
+	struct plan_type *plan;
+	struct chunk_list_type *current;
+	unsigned index;
+
+	plan = (struct plan_type *)malloc(sizeof(struct plan_type));
+	plan->segment = segment;
+	plan->batched = plan->staged = 0;
+	plan->next = NULL;
+
+	for (plan->count = 0, current = segment->chunks; current; current = current->next)
+		plan->count++;
+
+	plan->sorted = (struct chunk_list_type **)malloc(plan->count * sizeof(struct chunk_list_type *));
+	plan->join = (unsigned char *)calloc(plan->count ? plan->count : 1, 1);
+
+	for (index = 0, current = segment->chunks; current; current = current->next)
+		plan->sorted[index++] = current;
+
+	qsort(plan->sorted, plan->count, sizeof(struct chunk_list_type *), compare_address);
+
+	return plan;
+}
+
+/*
+only plain data and plain FILL blocks that overlap nothing else in their segment can be merged regardless of order
+*/
+
+static int joinable_chunk(struct segment_list_type *segment, const struct chunk_list_type *chunk)
+{
+	if ( (chunk->flags != 0) && (chunk->flags != BFLAG_FILL) )
+		return 0;
+	if (!chunk->flags && !chunk->data)
+		return 0;
+
+	return !overlaps_other_chunk(segment, chunk);
+}
+
+/*
+a gap can only be filled if no block anywhere in the image writes to it
+*/
+
+static int gap_is_unused(struct plan_type *plans, unsigned address, unsigned length)
+{
+	unsigned index;
+
+	for (; plans; plans = plans->next)
+		for (index = 0; index < plans->count; index++)
+			if (ranges_overlap(address, length, plans->sorted[index]->address, plans->sorted[index]->length))
+				return 0;
+
+	return 1;
+}
+
+static int compare_address(const void *a, const void *b)
+{
+	const struct chunk_list_type *x = *(const struct chunk_list_type * const *)a;
+	const struct chunk_list_type *y = *(const struct chunk_list_type * const *)b;
+
+	if (x->address != y->address)
+		return (x->address < y->address) ? -1 : 1;
+
+	return (x->length < y->length) ? -1 : (x->length > y->length);
+}
+
+static int compare_candidate(const void *a, const void *b)
+{
+	const struct candidate_type *x = (const struct candidate_type *)a;
+	const struct candidate_type *y = (const struct candidate_type *)b;
+	double x_ratio, y_ratio;
+
+	/* transformations that don't grow the image go first, then by boot time saved per byte added */
+	if ( (x->delta_bytes <= 0) != (y->delta_bytes <= 0) )
+		return (x->delta_bytes <= 0) ? -1 : 1;
+
+	if (x->delta_bytes <= 0)
+		return (x->delta_us < y->delta_us) ? -1 : (x->delta_us > y->delta_us);
+
+	x_ratio = -x->delta_us / x->delta_bytes;
+	y_ratio = -y->delta_us / y->delta_bytes;
+
+	return (x_ratio > y_ratio) ? -1 : (x_ratio < y_ratio);
+}
+
+/*
+merge each run of joined chunks into the first chunk of the run, which keeps its place in the segment
+*/
+
+static void apply_plan(struct plan_type *plan)
+{
+	struct chunk_list_type *keep, *other, **link;
+	unsigned index, start, end, offset, length, byte;
+	unsigned char *data;
+
+	for (start = 0; start < plan->count; start = end + 1)
+	{
+		for (end = start; (end + 1 < plan->count) && plan->join[end]; end++);
+
+		if (end == start)
+			continue;
+
+		length = plan->sorted[end]->address + plan->sorted[end]->length - plan->sorted[start]->address;
+		data = (unsigned char *)calloc(length ? length : 1, 1); /* gaps are bridged with zeros */
+
+		for (index = start; index <= end; index++)
+		{
+			other = plan->sorted[index];
+			offset = other->address - plan->sorted[start]->address;
+
+			if ( (index > start) && (other->address > plan->sorted[index - 1]->address + plan->sorted[index - 1]->length) )
+				statistics.gaps_bridged++;
+
+			if (other->flags & BFLAG_FILL)
+			{
+				/* unroll the FILL block */
+				statistics.fills_unrolled++;
+				for (byte = 0; byte < other->length; byte++)
+					data[offset + byte] = ((unsigned char *)&other->argument)[byte & 3];
+			}
+			else
+			{
+				memcpy(data + offset, other->data, other->length);
+			}
+		}
+
+		keep = plan->sorted[start];
+		keep->length = length;
+		keep->flags = 0;
+		keep->argument = 0;
+		free(keep->data);
+		keep->data = data;
+
+		for (index = start + 1; index <= end; index++)
+		{
+			other = plan->sorted[index];
+
+			for (link = &plan->segment->chunks; *link != other; link = &(*link)->next);
+			*link = other->next;
+
+			free(other->data);
+			free(other);
+		}
+	}
+}
+
+/*
+The Boot ROM's DMA is quicker when a payload starts on a --stream-align boundary of the boot stream and is written to a --dest-align
+boundary of memory, and the flash is quicker when no block header straddles a --page-size page.  The cost of falling short is given
+by page_cross_us and unaligned_us in the --profile, and alignment is only bought (with padding) when the model says that it pays.
+*/
+
+static int header_straddles(unsigned offset)
+{
+	if (!options.page_size)
+		return 0;
+
+	return (offset / options.page_size) != ((offset + options.format->header_size - 1) / options.page_size);
+}
+
+static int payload_unaligned(unsigned offset, unsigned address, unsigned length)
+{
+	if (options.stream_align && (offset % options.stream_align))
+		return 1;
+	if (options.dest_align && ((address % options.dest_align) || (length % options.dest_align)))
+		return 1;
+
+	return 0;
+}
+
+/*
+choose the size of an Ignore Block (zero for none) to write at offset ahead of the chunk, looking only as far as the next header
+*/
+
+static unsigned choose_padding(unsigned offset, const struct chunk_list_type *chunk)
+{
+	unsigned padding, best, limit, header, payload;
+	double cost, best_cost;
+
+	if (!options.page_size && !options.stream_align)
+		return 0;
+
+	header = options.format->header_size;
+	payload = chunk->data ? chunk->length : 0;
+
+	best = 0;
+	best_cost = 1e300;
+	limit = 2 * header + (options.page_size > options.stream_align ? options.page_size : options.stream_align);
+
+	for (padding = 0; (padding <= limit) && (padding <= options.size_slack); padding = padding ? padding + 1 : header)
+	{
+		cost = 0.0;
+
+		if (padding)
+		{
+			cost += options.model.header_us + options.model.handshake_us + options.model.host_transfer_us;
+			cost += header_straddles(offset) * options.model.page_cross_us;
+		}
+
+		cost += header_straddles(offset + padding) * options.model.page_cross_us;
+		if (payload && payload_unaligned(offset + padding + header, 0, 0))
+			cost += options.model.unaligned_us;
+		cost += header_straddles(offset + padding + header + payload) * options.model.page_cross_us;
+
+		if (cost < best_cost)
+		{
+			best = padding;
+			best_cost = cost;
+		}
+	}
+
+	return best;
+}
+
+static void write_padding(struct buffer_type *handle, unsigned length, struct image_settings_type *settings)
+{
+	struct block_header_type hdr;
+	unsigned char *erased;
+
+	memset(&hdr, 0, sizeof(struct block_header_type));
+
+	hdr.block_code.bcode = settings->bcode;
+	hdr.block_code.flags = BFLAG_IGNORE;
+	hdr.block_code.hdrsign = settings->hdrsign;
+	hdr.byte_count = length - options.format->header_size;
+
+	write_header(handle, &hdr);
+
+	/* the payload is never read, so it is left as erased flash */
+	erased = (unsigned char *)malloc(hdr.byte_count ? hdr.byte_count : 1);
+	memset(erased, 0xFF, hdr.byte_count);
+	buffer_append(handle, erased, hdr.byte_count);
+	free(erased);
+}
+
+/*
+pad data blocks out to --dest-align boundaries, but only into RAM of the memory map that no block anywhere in the image
+writes to; without a map, the padding could land on memory-mapped registers or another core's memory, so there is none
+*/
+
+static void align_destinations(struct application_list_type *applications)
+{
+	struct plan_type *plans, *plan;
+	struct chunk_list_type *chunk;
+	const struct region_type *region;
+	unsigned index, head, tail;
+	unsigned char *data;
+	double cost;
+
+	if (!options.region_count)
+	{
+		fprintf(stderr, "WARNING: --dest-align only pads within RAM of a memory map (--family or --memory-map); no padding added\n");
+		return;
+	}
+
+	plans = make_plans(applications);
+
+	for (plan = plans; plan; plan = plan->next)
+		for (index = 0; index < plan->count; index++)
+		{
+			chunk = plan->sorted[index];
+
+			if (chunk->flags || !joinable_chunk(plan->segment, chunk))
+				continue;
+
+			head = chunk->address % options.dest_align;
+			tail = (options.dest_align - (chunk->address + chunk->length) % options.dest_align) % options.dest_align;
+
+			if (!head && !tail)
+				continue;
+			if (head > chunk->address)
+				continue;
+			if (!in_ram_region(chunk->address - head, head + chunk->length + tail))
+				continue;
+			if (!gap_is_unused(plans, chunk->address - head, head) || !gap_is_unused(plans, chunk->address + chunk->length, tail))
+				continue;
+
+			region = find_region(chunk->address);
+			cost = (head + tail) * (options.model.byte_ns + (region ? region->write_ns : 0.0)) / 1000.0;
+			if ( (cost >= options.model.unaligned_us) || (head + tail > options.size_slack) )
+				continue;
+			options.size_slack -= head + tail;
+
+			data = (unsigned char *)calloc(head + chunk->length + tail, 1); /* padded with zeros */
+			memcpy(data + head, chunk->data, chunk->length);
+			free(chunk->data);
+			chunk->data = data;
+			chunk->address -= head;
+			chunk->length += head + tail;
+		}
+
+	free_plans(plans);
+}
+
+/*
+add the data to the memory image, overwriting whatever was there and merging with any extent that it overlaps or touches
+*/
+
+static void paint_extent(struct extent_type **extents, unsigned address, const unsigned char *data, unsigned length)
+{
+	struct extent_type **link, *first, *extent, *next, *merged;
+	unsigned long long low, high;
+
+	if (!length)
+		return;
+
+	low = address;
+	high = (unsigned long long)address + length;
+
+	for (link = extents; *link && ((unsigned long long)(*link)->address + (*link)->length < low); link = &(*link)->next);
+
+	first = *link;
+
+	for (extent = first; extent && (extent->address <= high); extent = extent->next)
+	{
+		if (extent->address < low)
+			low = extent->address;
+		if ((unsigned long long)extent->address + extent->length > high)
+			high = (unsigned long long)extent->address + extent->length;
+	}
+
+	/* growing a single extent (e.g. appending contiguous blocks) is done in place, rather than copying it every time */
+	if (first && (first->next == extent) && (first->address == low))
+	{
+		first->data = (unsigned char *)realloc(first->data, (unsigned)(high - low));
+		first->length = (unsigned)(high - low);
+		memcpy(first->data + (address - first->address), data, length);
+		return;
+	}
+
+	merged = (struct extent_type *)malloc(sizeof(struct extent_type));
+	merged->address = (unsigned)low;
+	merged->length = (unsigned)(high - low);
+	merged->data = (unsigned char *)malloc(merged->length);
+	merged->next = extent;
+
+	for (; first != extent; first = next)
+	{
+		next = first->next;
+		memcpy(merged->data + (first->address - merged->address), first->data, first->length);
+		free(first->data);
+		free(first);
+	}
+
+	memcpy(merged->data + (address - merged->address), data, length);
+	*link = merged;
+}
+
+/*
+the memory image that the loader image leaves behind (not including whatever the INIT routines themselves do)
+*/
+
+static struct extent_type *memory_image(struct application_list_type *applications)
+{
+	struct extent_type *extents;
+	struct segment_list_type *segment;
+	struct chunk_list_type *chunk;
+	unsigned char *fill;
+	unsigned byte;
+
+	extents = NULL;
+
+	for (; applications; applications = applications->next)
+		for (segment = applications->segments; segment; segment = segment->next)
+			for (chunk = segment->chunks; chunk; chunk = chunk->next)
+			{
+				if (chunk->data)
+				{
+					paint_extent(&extents, chunk->address, chunk->data, chunk->length);
+				}
+				else if ((chunk->flags & BFLAG_FILL) && chunk->length)
+				{
+					fill = (unsigned char *)malloc(chunk->length);
+					for (byte = 0; byte < chunk->length; byte++)
+						fill[byte] = ((unsigned char *)&chunk->argument)[byte & 3];
+					paint_extent(&extents, chunk->address, fill, chunk->length);
+					free(fill);
+				}
+			}
+
+	return extents;
+}
+
+static void free_extents(struct extent_type *extents)
+{
+	struct extent_type *next;
+
+	for (; extents; extents = next)
+	{
+		next = extents->next;
+		free(extents->data);
+		free(extents);
+	}
+}
+
+/*
+the length of the leading part of a range that lies in a single region (or outside of all of them)
+*/
+
+static unsigned region_piece(unsigned address, unsigned length)
+{
+	const struct region_type *region;
+	unsigned long long end;
+	unsigned index;
+
+	end = (unsigned long long)address + length;
+	region = find_region(address);
+
+	if (region)
+	{
+		if ((unsigned long long)region->end + 1 < end)
+			end = (unsigned long long)region->end + 1;
+	}
+	else
+	{
+		for (index = 0; index < options.region_count; index++)
+			if ( (options.regions[index].start > address) && (options.regions[index].start < end) )
+				end = options.regions[index].start;
+	}
+
+	return (unsigned)(end - address);
+}
+
+/*
+The memory image is written as <prefix>.map plus one binary file per extent (split at region boundaries).  Each line of the map is
+
+  <address> <length> <file>   # <region>
+
+where the file name is relative to the directory of the map.
+*/
+
+static int export_memory(const char *prefix, struct extent_type *extents)
+{
+	FILE *map, *handle;
+	const struct region_type *region;
+	const char *base;
+	char name[1024], region_name[32];
+	unsigned address, offset, length, index;
+
+	snprintf(name, sizeof(name), "%s.map", prefix);
+	map = fopen(name, "w");
+	if (NULL == map)
+		return -1;
+
+	for (base = prefix + strlen(prefix); (base > prefix) && (base[-1] != '/') && (base[-1] != '\\'); base--);
+
+	fprintf(map, "# address length file (region)\n");
+
+	for (; extents; extents = extents->next)
+		for (offset = 0; offset < extents->length; offset += length)
+		{
+			address = extents->address + offset;
+			length = region_piece(address, extents->length - offset);
+			region = find_region(address);
+
+			/* region names become part of the file name, so anything but letters and digits is replaced */
+			snprintf(region_name, sizeof(region_name), "%s", region ? region->name : "unmapped");
+			for (index = 0; region_name[index]; index++)
+				if (!isalnum((unsigned char)region_name[index]))
+					region_name[index] = '_';
+
+			snprintf(name, sizeof(name), "%s-%s-%08x.bin", prefix, region_name, address);
+			handle = fopen(name, "wb");
+			if (NULL == handle)
+			{
+				fclose(map);
+				return -1;
+			}
+			fwrite(extents->data + offset, length, 1, handle);
+			fclose(handle);
+
+			fprintf(map, "0x%08x 0x%x %s-%s-%08x.bin   # %s\n", address, length, base, region_name, address, region ? region->name : "unmapped");
+		}
+
+	fclose(map);
+
+	return 0;
+}
+
+/*
+read a memory image (as written by export_memory) and synthesize the blocks that load it
+*/
+
+static struct chunk_list_type *import_memory(const char *name, unsigned *count)
+{
+	FILE *map;
+	struct extent_type *extents, *extent;
+	struct chunk_list_type *chunks, **tail, *chunk;
+	const struct region_type *region;
+	char line[1280], address[24], length[24], file[1024], path[2048];
+	unsigned char *data;
+	unsigned data_length, offset, piece;
+	int directory;
+
+	map = fopen(name, "r");
+	if (NULL == map)
+		return NULL;
+
+	for (directory = strlen(name); (directory > 0) && (name[directory - 1] != '/') && (name[directory - 1] != '\\'); directory--);
+
+	extents = NULL;
+
+	while (fgets(line, sizeof(line), map))
+	{
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+
+		if (sscanf(line, "%23s %23s %1023s", address, length, file) < 3)
+			continue;
+
+		snprintf(path, sizeof(path), "%.*s%s", directory, name, file);
+		data = load_file(path, &data_length);
+
+		if ( (NULL == data) || (data_length < strtoul(length, NULL, 0)) )
+		{
+			fprintf(stderr, "ERROR: unable to read %s\n", path);
+			free(data);
+			free_extents(extents);
+			fclose(map);
+			return NULL;
+		}
+
+		paint_extent(&extents, strtoul(address, NULL, 0), data, strtoul(length, NULL, 0));
+		free(data);
+	}
+
+	fclose(map);
+
+	chunks = NULL;
+	tail = &chunks;
+
+	for (extent = extents; extent; extent = extent->next)
+		for (offset = 0; offset < extent->length; offset += piece)
+		{
+			piece = region_piece(extent->address + offset, extent->length - offset);
+			region = find_region(extent->address + offset);
+
+			if (region && (REGION_MMR == region->kind))
+			{
+				fprintf(stderr, "WARNING: not loading MMR contents at 0x%x\n", extent->address + offset);
+				continue;
+			}
+
+			tail = synthesize_chunks(tail, extent->address + offset, extent->data + offset, piece);
+		}
+
+	free_extents(extents);
+
+	for (*count = 0, chunk = chunks; chunk; chunk = chunk->next)
+		(*count)++;
+
+	return chunks;
+}
+
+/*
+load a range of memory with data blocks, except for runs of a repeated 32-bit word that the model says are quicker as FILL blocks
+*/
+
+static struct chunk_list_type **synthesize_chunks(struct chunk_list_type **tail, unsigned address, const unsigned char *data, unsigned length)
+{
+	unsigned start, offset, run, word, pieces;
+	double header_cost;
+
+	header_cost = options.model.header_us + options.model.handshake_us + options.model.host_transfer_us;
+
+	start = 0;
+	offset = (4 - address % 4) % 4;
+
+	while (offset + 4 <= length)
+	{
+		for (run = 4; (offset + run + 4 <= length) && !memcmp(data + offset, data + offset + run, 4); run += 4);
+
+		/* the FILL block costs as many headers as the data block it is cut out of is split into */
+		pieces = (offset > start) + 1 + (offset + run < length);
+
+		if (run * (options.model.byte_ns - options.model.fill_ns) / 1000.0 > (pieces - 1) * header_cost)
+		{
+			if (offset > start)
+				tail = append_chunk(tail, address + start, 0, 0, data + start, offset - start);
+
+			memcpy(&word, data + offset, 4);
+			tail = append_chunk(tail, address + offset, BFLAG_FILL, word, NULL, run);
+			start = offset + run;
+		}
+
+		offset += run;
+	}
+
+	if (length > start)
+		tail = append_chunk(tail, address + start, 0, 0, data + start, length - start);
+
+	return tail;
+}
+
+static struct chunk_list_type **append_chunk(struct chunk_list_type **tail, unsigned address, unsigned flags, unsigned argument, const unsigned char *data, unsigned length)
+{
+	struct chunk_list_type *chunk;
+
+	chunk = (struct chunk_list_type *)malloc(sizeof(struct chunk_list_type));
+	memset(chunk, 0, sizeof(struct chunk_list_type));
+	chunk->address = address;
+	chunk->flags = flags;
+	chunk->argument = argument;
+	chunk->length = length;
+
+	if (data)
+	{
+		chunk->data = (unsigned char *)malloc(length);
+		memcpy(chunk->data, data, length);
+	}
+
+	*tail = chunk;
+
+	return &chunk->next;
+}
+
+/*
+abbreviated ELF32 definitions from the System V ABI; a .dxe is an ELF file
+*/
+#define ELF_SHT_SYMTAB   2
+#define ELF_SHT_NOBITS   8
+#define ELF_SHF_ALLOC    0x2
+#define ELF_STT_OBJECT   1
+#define ELF_STT_FUNC     2
+#define ELF_EHDR_SIZE    52
+#define ELF_SHDR_SIZE    40
+#define ELF_SYM_SIZE     16
+
+static int elf_big_endian;
+
+static unsigned elf_value(const unsigned char *data, unsigned size)
+{
+	unsigned value, index;
+
+	for (value = 0, index = 0; index < size; index++)
+		value |= (unsigned)data[elf_big_endian ? index : size - 1 - index] << (8 * (size - 1 - index));
+
+	return value;
+}
+
+/*
+read the allocated sections and the object and function symbols; names point into the file, which is kept
+*/
+
+static int load_elf(const char *name)
+{
+	unsigned length, shoff, shnum, shstrndx, index, symbol, type, count;
+	const unsigned char *shdr, *strtab_shdr, *sym;
+	const char *names;
+	struct attribution_type *item;
+
+	elf.file = load_file(name, &length);
+	if (NULL == elf.file)
+		return -1;
+
+	if ( (length < ELF_EHDR_SIZE) || memcmp(elf.file, "\177ELF", 4) || (1 != elf.file[4]) )
+	{
+		fprintf(stderr, "ERROR: %s is not a 32-bit ELF file\n", name);
+		return -1;
+	}
+
+	elf_big_endian = (2 == elf.file[5]);
+
+	shoff = elf_value(elf.file + 32, 4);
+	shnum = elf_value(elf.file + 48, 2);
+	shstrndx = elf_value(elf.file + 50, 2);
+
+	if ( (shoff > length) || (shnum > (length - shoff) / ELF_SHDR_SIZE) || (shstrndx >= shnum) )
+		return -1;
+
+	#define SHDR(i) (elf.file + shoff + (i) * ELF_SHDR_SIZE)
+	#define IN_FILE(offset, size) (((offset) <= length) && ((size) <= length - (offset)))
+
+	if (!IN_FILE(elf_value(SHDR(shstrndx) + 16, 4), elf_value(SHDR(shstrndx) + 20, 4)))
+		return -1;
+	names = (const char *)elf.file + elf_value(SHDR(shstrndx) + 16, 4);
+
+	elf.sections = (struct attribution_type *)calloc(shnum ? shnum : 1, sizeof(struct attribution_type));
+	elf.symbols = NULL;
+	count = 0;
+
+	for (index = 0; index < shnum; index++)
+	{
+		shdr = SHDR(index);
+		type = elf_value(shdr + 4, 4);
+
+		if ( (ELF_SHT_SYMTAB == type) && (elf_value(shdr + 24, 4) < shnum) )
+		{
+			/* the symbols (and the string table they are named from) */
+			strtab_shdr = SHDR(elf_value(shdr + 24, 4));
+			if (!IN_FILE(elf_value(shdr + 16, 4), elf_value(shdr + 20, 4)) || !IN_FILE(elf_value(strtab_shdr + 16, 4), elf_value(strtab_shdr + 20, 4)))
+				continue;
+
+			for (symbol = 0; symbol < elf_value(shdr + 20, 4) / ELF_SYM_SIZE; symbol++)
+			{
+				sym = elf.file + elf_value(shdr + 16, 4) + symbol * ELF_SYM_SIZE;
+
+				if ( ((sym[12] & 0xF) != ELF_STT_OBJECT) && ((sym[12] & 0xF) != ELF_STT_FUNC) )
+					continue;
+				if (!elf_value(sym + 8, 4) || (elf_value(sym + 0, 4) >= elf_value(strtab_shdr + 20, 4)))
+					continue;
+
+				if (!(count & (count + 1)))
+					elf.symbols = (struct attribution_type *)realloc(elf.symbols, (2 * count + 1) * sizeof(struct attribution_type));
+
+				item = &elf.symbols[count++];
+				memset(item, 0, sizeof(struct attribution_type));
+				item->name = (const char *)elf.file + elf_value(strtab_shdr + 16, 4) + elf_value(sym + 0, 4);
+				item->address = elf_value(sym + 4, 4);
+				item->length = elf_value(sym + 8, 4);
+			}
+
+			continue;
+		}
+
+		if ( !(elf_value(shdr + 8, 4) & ELF_SHF_ALLOC) || !elf_value(shdr + 20, 4) )
+			continue;
+
+		item = &elf.sections[elf.section_count++];
+		item->name = names + elf_value(shdr + 0, 4);
+		item->address = elf_value(shdr + 12, 4);
+		item->length = elf_value(shdr + 20, 4);
+
+		/* an initialized section whose contents are all zero costs boot time that a NOBITS section would not */
+		if ( (ELF_SHT_NOBITS != type) && IN_FILE(elf_value(shdr + 16, 4), item->length) )
+		{
+			for (symbol = 0; symbol < item->length; symbol++)
+				if (elf.file[elf_value(shdr + 16, 4) + symbol])
+					break;
+			item->zero_initialized = (symbol == item->length);
+		}
+	}
+
+	#undef SHDR
+	#undef IN_FILE
+
+	elf.symbol_count = count;
+
+	return 0;
+}
+
+/*
+share the cost of a block out among the sections and symbols that it loads, in proportion to the bytes of each
+*/
+
+static void attribute_block(const struct block_header_type *hdr, unsigned offset, double start_us, const struct block_cost_type *cost)
+{
+	unsigned index, overlap, covered;
+	unsigned long long low, high;
+	struct attribution_type *item;
+	double cost_us;
+
+	(void)offset;
+	(void)start_us;
+	cost_us = cost->total_us;
+
+	if ( (hdr->block_code.flags & (BFLAG_IGNORE | BFLAG_FIRST)) || !hdr->byte_count )
+	{
+		elf.overhead_us += cost_us;
+		return;
+	}
+
+	covered = 0;
+
+	for (index = 0; index < elf.section_count + elf.symbol_count; index++)
+	{
+		item = (index < elf.section_count) ? &elf.sections[index] : &elf.symbols[index - elf.section_count];
+
+		low = (item->address > hdr->target_address) ? item->address : hdr->target_address;
+		high = (unsigned long long)item->address + item->length;
+		if ((unsigned long long)hdr->target_address + hdr->byte_count < high)
+			high = (unsigned long long)hdr->target_address + hdr->byte_count;
+		if (high <= low)
+			continue;
+
+		overlap = (unsigned)(high - low);
+		item->bytes += overlap;
+		item->cost_us += cost_us * overlap / hdr->byte_count;
+
+		if (index < elf.section_count)
+			covered += overlap;
+	}
+
+	if (covered < hdr->byte_count)
+		elf.unattributed_us += cost_us * (hdr->byte_count - covered) / hdr->byte_count;
+}
+
+static void print_attribution(struct attribution_type *items, unsigned count, unsigned limit, double total)
+{
+	unsigned index;
+
+	qsort(items, count, sizeof(struct attribution_type), compare_attribution);
+
+	for (index = 0; (index < count) && (index < limit); index++)
+	{
+		if (!items[index].bytes)
+			break;
+
+		fprintf(options.listing, "%8.0f us %5.1f%%  %s (0x%x 0x%x) %u bytes loaded", items[index].cost_us, total ? 100.0 * items[index].cost_us / total : 0.0,
+		       items[index].name, items[index].address, items[index].length, items[index].bytes);
+
+		if (items[index].zero_initialized)
+			fprintf(options.listing, "; all zero, could be BSS");
+
+		fprintf(options.listing, "\n");
+	}
+}
+
+static int compare_attribution(const void *a, const void *b)
+{
+	const struct attribution_type *x = (const struct attribution_type *)a;
+	const struct attribution_type *y = (const struct attribution_type *)b;
+
+	return (x->cost_us > y->cost_us) ? -1 : (x->cost_us < y->cost_us);
+}
+
+static struct plan_type *make_plans(struct application_list_type *applications)
+{
+	struct segment_list_type *segment;
+	struct plan_type *plans, **link;
+
+	plans = NULL;
+	link = &plans;
+
+	for (; applications; applications = applications->next)
+		for (segment = applications->segments; segment; segment = segment->next)
+			if (segment->chunks)
+			{
+				*link = make_plan(segment);
+				link = &(*link)->next;
+			}
+
+	return plans;
+}
+
+static void free_plans(struct plan_type *plans)
+{
+	struct plan_type *plan;
+
+	while (plans)
+	{
+		plan = plans;
+		plans = plans->next;
+		free(plan->sorted);
+		free(plan->join);
+		free(plan);
+	}
+}
+
+/*
+Read the section placements from a GNU ld style map file.  An output section starts in the first column and the input sections
+that make it up are indented by one space; in both cases the name is followed by the address and size, which are pushed onto
+the next line when the name is too long:
+
+  .data           0x20000240       0x40
+   .data          0x20000240       0x20 main.o
+   .data.very_long_name
+                  0x20000260       0x20 table.o
+*/
+
+static int load_linker_map(const char *name)
+{
+	FILE *handle;
+	char line[1024], section[256], address[32], size[32], object[512], label[800];
+	struct attribution_type *item;
+	unsigned allocated;
+	int fields, pending, indented;
+
+	handle = fopen(name, "r");
+	if (NULL == handle)
+		return -1;
+
+	allocated = 0;
+	pending = indented = 0;
+
+	while (fgets(line, sizeof(line), handle))
+	{
+		object[0] = '\0';
+
+		if (pending && (' ' == line[0]))
+		{
+			/* the address and size of a section whose name was on a line by itself */
+			fields = sscanf(line, "%31s %31s %511s", address, size, object);
+			fields = (fields >= 2) ? fields + 1 : 0;
+		}
+		else
+		{
+			indented = (' ' == line[0]) && (' ' != line[1]);
+			if ('.' != line[indented])
+			{
+				pending = 0;
+				continue;
+			}
+			fields = sscanf(line, "%255s %31s %31s %511s", section, address, size, object);
+		}
+
+		pending = (1 == fields);
+
+		if ( (fields < 3) || strncmp(address, "0x", 2) || strncmp(size, "0x", 2) || !strtoul(size, NULL, 0) )
+			continue;
+
+		if (linker_map.count == allocated)
+		{
+			allocated = 2 * allocated + 64;
+			linker_map.sections = (struct attribution_type *)realloc(linker_map.sections, allocated * sizeof(struct attribution_type));
+		}
+
+		if (object[0])
+			snprintf(label, sizeof(label), "%s (%s)", section, object);
+		else
+			snprintf(label, sizeof(label), "%s", section);
+
+		item = &linker_map.sections[linker_map.count++];
+		memset(item, 0, sizeof(struct attribution_type));
+		item->name = strcpy((char *)malloc(strlen(label) + 1), label);
+		item->address = strtoul(address, NULL, 0);
+		item->length = strtoul(size, NULL, 0);
+	}
+
+	fclose(handle);
+
+	return 0;
+}
+
+/*
+the smallest section (from the linker map, and failing that the ELF) that holds the address
+*/
+
+static const struct attribution_type *find_section(unsigned address)
+{
+	const struct attribution_type *best, *items;
+	unsigned index, count, pass;
+
+	best = NULL;
+
+	for (pass = 0; !best && (pass < 2); pass++)
+	{
+		items = pass ? elf.sections : linker_map.sections;
+		count = pass ? elf.section_count : linker_map.count;
+
+		for (index = 0; index < count; index++)
+			if ( (address >= items[index].address) && (address - items[index].address < items[index].length) )
+				if (!best || (items[index].length <= best->length)) /* on a tie, the input section listed after its output section */
+					best = &items[index];
+	}
+
+	return best;
+}
+
+/*
+Once everything that can be merged has been, each remaining gap between two data blocks of a segment in the same region costs
+a block header that packing the sections on either side together in the linker description file would save.  Without a memory
+map there is no telling L2 from DDR, so no advice is given.
+*/
+
+static void advise_layout(struct application_list_type *applications)
+{
+	struct plan_type *plans, *plan;
+	struct chunk_list_type *left, *right;
+	const struct attribution_type *before, *after;
+	unsigned index, gap, count;
+	double header_cost, bridged, total;
+
+	header_cost = options.model.header_us + options.model.handshake_us + options.model.host_transfer_us;
+
+	plans = make_plans(applications);
+	count = 0;
+	total = 0.0;
+
+	fprintf(options.listing, "--- layout advice\n");
+
+	if (!options.region_count)
+	{
+		fprintf(options.listing, "no memory map (--family or --memory-map), so no gap is known to be closable\n");
+		free_plans(plans);
+		return;
+	}
+
+	for (plan = plans; plan; plan = plan->next)
+		for (index = 0; index + 1 < plan->count; index++)
+		{
+			left = plan->sorted[index];
+			right = plan->sorted[index + 1];
+
+			if (left->flags || right->flags || !left->data || !right->data)
+				continue;
+			if (!find_region(left->address) || !same_region(left->address, left->length, right->address, right->length))
+				continue;
+			if (left->address + left->length >= right->address)
+				continue;
+
+			gap = right->address - (left->address + left->length);
+			before = find_section(left->address + left->length - 1);
+			after = find_section(right->address);
+
+			fprintf(options.listing, "gap 0x%x 0x%x between %s and %s: packing them together saves %.0f us", left->address + left->length, gap,
+			       before ? before->name : "(no section)", after ? after->name : "(no section)", header_cost);
+
+			/* ...though where the gap is unused, bridging it might be nearly as good */
+			bridged = header_cost - gap * options.model.byte_ns / 1000.0;
+			if ( (bridged > 0.0) && in_ram_region(left->address + left->length, gap) && gap_is_unused(plans, left->address + left->length, gap) )
+				fprintf(options.listing, " (--bridge=%u saves %.0f us)", gap, bridged);
+
+			fprintf(options.listing, "\n");
+
+			count++;
+			total += header_cost;
+		}
+
+	fprintf(options.listing, "%u gaps cost %u block headers, about %.0f us\n", count, count, total);
+
+	free_plans(plans);
+}
+
+/*
+end the current phase of the tool (if any) and start the next (unless name is NULL)
+*/
+
+static void begin_phase(const char *name)
+{
+	double now;
+
+	now = now_us();
+
+	if (statistics.phase_count)
+		statistics.phases[statistics.phase_count - 1].seconds = (now - statistics.phases[statistics.phase_count - 1].start_us) / 1e6;
+
+	if (!name || (statistics.phase_count >= MAX_PHASES))
+		return;
+
+	statistics.phases[statistics.phase_count].name = name;
+	statistics.phases[statistics.phase_count].start_us = now;
+	statistics.phases[statistics.phase_count].allocations = allocation_count;
+	statistics.phases[statistics.phase_count].seconds = 0.0;
+	statistics.phase_count++;
+}
+
+static double now_us(void)
+{
+#ifdef _WIN32
+	return 1e6 * clock() / CLOCKS_PER_SEC;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return 1e6 * now.tv_sec + now.tv_nsec / 1e3;
+#endif
+}
+
+static void record_span(const char *name, unsigned application, double start_us)
+{
+	struct span_type *span;
+
+	if (statistics.span_count == statistics.span_allocated)
+	{
+		statistics.span_allocated = 2 * statistics.span_allocated + 16;
+		statistics.spans = (struct span_type *)realloc(statistics.spans, statistics.span_allocated * sizeof(struct span_type));
+	}
+
+	span = &statistics.spans[statistics.span_count++];
+	span->name = name;
+	span->application = application;
+	span->start_us = start_us;
+	span->duration_us = now_us() - start_us;
+}
+
+/*
+the most memory that the tool has used, or zero where that isn't known
+*/
+
+static unsigned peak_rss_kb(void)
+{
+#ifdef _WIN32
+	return 0;
+#else
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0;
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024; /* bytes rather than kilobytes */
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+/*
+the phases (and the applications within them) as a Chrome trace (JSON object format), viewable in chrome://tracing or Perfetto
+*/
+
+static int write_trace(const char *name)
+{
+	FILE *handle;
+	unsigned index;
+
+	handle = fopen(name, "w");
+	if (NULL == handle)
+		return -1;
+
+	fprintf(handle, "{\n\"traceEvents\": [\n");
+	fprintf(handle, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"ldrshrink\"}}");
+
+	for (index = 0; index < statistics.phase_count; index++)
+	{
+		fprintf(handle, ",\n{\"name\": \"%s\", \"cat\": \"phase\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f}",
+		        statistics.phases[index].name, statistics.phases[index].start_us - statistics.origin_us, statistics.phases[index].seconds * 1e6);
+		fprintf(handle, ",\n{\"name\": \"allocations\", \"ph\": \"C\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"args\": {\"count\": %u}}",
+		        statistics.phases[index].start_us - statistics.origin_us, statistics.phases[index].allocations);
+	}
+
+	for (index = 0; index < statistics.span_count; index++)
+		fprintf(handle, ",\n{\"name\": \"%s\", \"cat\": \"application\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"application\": %u}}",
+		        statistics.spans[index].name, statistics.spans[index].start_us - statistics.origin_us, statistics.spans[index].duration_us, statistics.spans[index].application);
+
+	fprintf(handle, "\n],\n\"otherData\": {\"peak_rss_kb\": %u, \"allocations\": %u}\n}\n", peak_rss_kb(), allocation_count);
+	fclose(handle);
+
+	return 0;
+}
+
+/*
+the statistics as text, JSON or CSV (name,value pairs) on stdout; non-zero if the format is unknown
+*/
+
+static int write_report(const char *format)
+{
+	static const char *names[] = { "input_blocks", "output_blocks", "input_bytes", "output_bytes", "fills_unrolled", "gaps_bridged", "overlaps_removed", "allocations", "peak_rss_kb" };
+	unsigned values[sizeof(names) / sizeof(names[0])];
+	unsigned index;
+	int json, csv;
+
+	json = !strcmp(format, "json");
+	csv = !strcmp(format, "csv");
+
+	if (!json && !csv && strcmp(format, "text"))
+		return -1;
+
+	values[0] = statistics.input_blocks;
+	values[1] = statistics.output_blocks;
+	values[2] = statistics.input_bytes;
+	values[3] = statistics.output_bytes;
+	values[4] = statistics.fills_unrolled;
+	values[5] = statistics.gaps_bridged;
+	values[6] = statistics.overlaps_removed;
+	values[7] = allocation_count;
+	values[8] = peak_rss_kb();
+
+	if (json)
+		printf("{\n");
+	else if (csv)
+		printf("name,value\n");
+	else
+		printf("--- statistics\n");
+
+	for (index = 0; index < sizeof(names) / sizeof(names[0]); index++)
+		printf(json ? "  \"%s\": %u,\n" : csv ? "%s,%u\n" : "%s %u\n", names[index], values[index]);
+
+	printf(json ? "  \"%s\": %.1f,\n" : csv ? "%s,%.1f\n" : "%s %.1f\n", "input_estimated_us", statistics.input_us);
+	printf(json ? "  \"%s\": %.1f,\n" : csv ? "%s,%.1f\n" : "%s %.1f\n", "output_estimated_us", statistics.output_us);
+
+	if (json)
+		printf("  \"phase_seconds\": {");
+
+	for (index = 0; index < statistics.phase_count; index++)
+	{
+		if (json)
+			printf("%s\n    \"%s\": %.6f", index ? "," : "", statistics.phases[index].name, statistics.phases[index].seconds);
+		else
+			printf(csv ? "phase_%s_seconds,%.6f\n" : "phase %s %.6f s\n", statistics.phases[index].name, statistics.phases[index].seconds);
+	}
+
+	if (json)
+		printf("\n  }\n}\n");
+
+	return 0;
+}
+
+/*
+The modelled boot as a Chrome trace (JSON object format), viewable in chrome://tracing or Perfetto: the input image is process 1 and
+the output image process 2, so the two can be compared side by side.  Each block is a span, broken down into its header, transfer,
+fill and INIT call.  The time is that of the model (in microseconds), not measured.
+*/
+
+static struct
+{
+	FILE *handle;
+	unsigned pid;
+} timeline;
+
+static int write_timeline(const char *name, const unsigned char *input, unsigned input_length, const unsigned char *output, unsigned output_length)
+{
+	timeline.handle = fopen(name, "w");
+	if (NULL == timeline.handle)
+		return -1;
+
+	fprintf(timeline.handle, "{\n\"traceEvents\": [\n");
+	fprintf(timeline.handle, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"input\"}},\n");
+	fprintf(timeline.handle, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, \"tid\": 1, \"args\": {\"name\": \"output\"}}");
+
+	timeline.pid = 1;
+	estimate_stream(input, input_length, timeline_block);
+	timeline.pid = 2;
+	estimate_stream(output, output_length, timeline_block);
+
+	fprintf(timeline.handle, "\n],\n\"displayTimeUnit\": \"ns\"\n}\n");
+	fclose(timeline.handle);
+
+	return 0;
+}
+
+static void timeline_block(const struct block_header_type *hdr, unsigned offset, double start_us, const struct block_cost_type *cost)
+{
+	char name[64];
+
+	if (hdr->block_code.flags & BFLAG_FIRST)
+		snprintf(name, sizeof(name), "First 0x%x", hdr->target_address);
+	else if (hdr->block_code.flags & BFLAG_IGNORE)
+		snprintf(name, sizeof(name), "Ignore 0x%x", hdr->byte_count);
+	else if ( (hdr->block_code.flags & BFLAG_FINAL) && !options.format->final_has_payload )
+		snprintf(name, sizeof(name), "Final");
+	else
+		snprintf(name, sizeof(name), "0x%x 0x%x%s%s", hdr->target_address, hdr->byte_count,
+		         (hdr->block_code.flags & BFLAG_FILL) ? " FILL" : "", (hdr->block_code.flags & BFLAG_INIT) ? " INIT" : "");
+
+	fprintf(timeline.handle, ",\n{\"name\": \"%s\", \"cat\": \"block\", \"ph\": \"X\", \"pid\": %u, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"offset\": %u}}",
+	        name, timeline.pid, start_us, cost->total_us, offset);
+
+	timeline_span("header", start_us, cost->header_us);
+	start_us += cost->header_us;
+	timeline_span("transfer", start_us, cost->transfer_us);
+	start_us += cost->transfer_us;
+	timeline_span("fill", start_us, cost->fill_us);
+	start_us += cost->fill_us;
+	timeline_span("INIT call", start_us, cost->init_us);
+}
+
+static void timeline_span(const char *name, double start_us, double duration_us)
+{
+	if (duration_us <= 0.0)
+		return;
+
+	fprintf(timeline.handle, ",\n{\"name\": \"%s\", \"cat\": \"phase\", \"ph\": \"X\", \"pid\": %u, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f}",
+	        name, timeline.pid, start_us, duration_us);
+}
+
+/*
+Calibration fits header_us, byte_ns and fill_ns to measured boot times by least squares.  The measurements are a CSV file of
+
+  <loader file>,<measured boot time in microseconds>
+
+with file names relative to the directory of the CSV file.  The model is linear in each of the three, so each loader file's
+sensitivity to one of them is found by estimating its boot time with just that one set to 1; everything else in the model
+(e.g. init_us and the region write costs) is held at its --profile value.  No cost can be negative, so the fit is constrained
+to non-negative values: every choice of which parameters to hold at zero is tried (there are only three), and the best fit with
+no negative parameter wins.
+*/
+
+#define CALIBRATED 3
+#define MAX_CALIBRATION_FILES 256
+
+static int calibrate(const char *name, const char *profile)
+{
+	static const char *names[CALIBRATED] = { "header_us", "byte_ns", "fill_ns" };
+	double *parameters[CALIBRATED];
+	double fixed[MAX_CALIBRATION_FILES], measured[MAX_CALIBRATION_FILES], sensitivity[MAX_CALIBRATION_FILES][CALIBRATED];
+	double normal[CALIBRATED * CALIBRATED], right[CALIBRATED], saved[CALIBRATED], best[CALIBRATED], error, squares, best_squares;
+	unsigned char *data;
+	unsigned data_length, count, row, column, other, used[CALIBRATED], used_count, fitted[CALIBRATED], fitted_count, subset;
+	char line[1280], file[1024], path[2048];
+	FILE *handle;
+	int directory;
+
+	parameters[0] = &options.model.header_us;
+	parameters[1] = &options.model.byte_ns;
+	parameters[2] = &options.model.fill_ns;
+
+	handle = fopen(name, "r");
+	if (NULL == handle)
+		return -1;
+
+	for (directory = strlen(name); (directory > 0) && (name[directory - 1] != '/') && (name[directory - 1] != '\\'); directory--);
+
+	for (column = 0; column < CALIBRATED; column++)
+		saved[column] = *parameters[column];
+
+	count = 0;
+
+	while (fgets(line, sizeof(line), handle) && (count < MAX_CALIBRATION_FILES))
+	{
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+
+		/* a heading (or anything else without a number after the comma) is skipped */
+		if ( (2 != sscanf(line, " %1023[^,],%lf", file, &measured[count])) )
+			continue;
+
+		snprintf(path, sizeof(path), "%.*s%s", directory, name, file);
+		data = load_file(path, &data_length);
+		if (data)
+			data = decode_input(data, &data_length);
+
+		if (NULL == data)
+		{
+			fprintf(stderr, "ERROR: unable to read %s\n", path);
+			fclose(handle);
+			return -1;
+		}
+
+		for (column = 0; column < CALIBRATED; column++)
+			*parameters[column] = 0.0;
+
+		fixed[count] = estimate_stream(data, data_length, NULL);
+
+		for (column = 0; column < CALIBRATED; column++)
+		{
+			*parameters[column] = 1.0;
+			sensitivity[count][column] = estimate_stream(data, data_length, NULL) - fixed[count];
+			*parameters[column] = 0.0;
+		}
+
+		free(data);
+		count++;
+	}
+
+	fclose(handle);
+
+	/* a parameter that none of the loader files exercise (e.g. fill_ns without FILL blocks) keeps its value */
+	used_count = 0;
+	for (column = 0; column < CALIBRATED; column++)
+	{
+		for (row = 0; row < count; row++)
+			if (sensitivity[row][column] > 0.0)
+				break;
+
+		if (row < count)
+			used[used_count++] = column;
+		else
+			fprintf(stderr, "WARNING: no measurement depends on %s; it is left at %g\n", names[column], saved[column]);
+	}
+
+	if (count < used_count)
+	{
+		fprintf(stderr, "ERROR: %u measurements cannot determine %u parameters\n", count, used_count);
+		return -1;
+	}
+
+	best_squares = -1.0;
+	memcpy(best, saved, sizeof(best));
+
+	for (subset = 0; subset < (1U << used_count); subset++)
+	{
+		/* the parameters in the subset are fitted, and the rest of those that are used are held at zero */
+		fitted_count = 0;
+		for (column = 0; column < used_count; column++)
+			if (subset & (1U << column))
+				fitted[fitted_count++] = used[column];
+
+		for (column = 0; column < CALIBRATED; column++)
+			*parameters[column] = saved[column];
+		for (column = 0; column < used_count; column++)
+			*parameters[used[column]] = 0.0;
+
+		/* the normal equations, with what the parameters that aren't fitted contribute moved to the right-hand side */
+		memset(normal, 0, sizeof(normal));
+		memset(right, 0, sizeof(right));
+
+		for (row = 0; row < count; row++)
+		{
+			error = measured[row] - fixed[row];
+			for (column = 0; column < CALIBRATED; column++)
+				error -= *parameters[column] * sensitivity[row][column];
+
+			for (column = 0; column < fitted_count; column++)
+			{
+				right[column] += sensitivity[row][fitted[column]] * error;
+				for (other = 0; other < fitted_count; other++)
+					normal[column * fitted_count + other] += sensitivity[row][fitted[column]] * sensitivity[row][fitted[other]];
+			}
+		}
+
+		if (fitted_count && solve_least_squares(normal, right, fitted_count))
+			continue;
+
+		for (column = 0; column < fitted_count; column++)
+			if (right[column] < 0.0)
+				break;
+		if (column < fitted_count)
+			continue;
+
+		for (column = 0; column < fitted_count; column++)
+			*parameters[fitted[column]] = right[column];
+
+		/* how well this fits */
+		squares = 0.0;
+		for (row = 0; row < count; row++)
+		{
+			error = fixed[row] - measured[row];
+			for (column = 0; column < CALIBRATED; column++)
+				error += *parameters[column] * sensitivity[row][column];
+			squares += error * error;
+		}
+
+		if ( (best_squares < 0.0) || (squares < best_squares) )
+		{
+			best_squares = squares;
+			for (column = 0; column < CALIBRATED; column++)
+				best[column] = *parameters[column];
+		}
+	}
+
+	if (best_squares < 0.0)
+	{
+		fprintf(stderr, "ERROR: the measurements do not tell the parameters apart; try loader files that differ more\n");
+		return -1;
+	}
+
+	squares = best_squares;
+	for (column = 0; column < CALIBRATED; column++)
+		*parameters[column] = best[column];
+
+	for (column = 0; column < used_count; column++)
+		if (0.0 == *parameters[used[column]])
+			fprintf(stderr, "WARNING: %s is held at 0, as the best fit would make it negative; the measurements may be inconsistent\n", names[used[column]]);
+
+	printf("--- calibration from %u measurements\n", count);
+	for (column = 0; column < CALIBRATED; column++)
+		printf("%s %g\n", names[column], *parameters[column]);
+	printf("RMS error %.1f us\n", count ? sqrt(squares / count) : 0.0);
+
+	return write_profile(profile);
+}
+
+/*
+Gaussian elimination with partial pivoting; the solution replaces vector
+*/
+
+static int solve_least_squares(double *matrix, double *vector, unsigned size)
+{
+	unsigned row, column, pivot, other;
+	double factor, swap;
+
+	for (column = 0; column < size; column++)
+	{
+		for (pivot = column, row = column + 1; row < size; row++)
+			if (fabs(matrix[row * size + column]) > fabs(matrix[pivot * size + column]))
+				pivot = row;
+
+		if (fabs(matrix[pivot * size + column]) < 1e-12)
+			return -1;
+
+		for (other = 0; other < size; other++)
+		{
+			swap = matrix[column * size + other];
+			matrix[column * size + other] = matrix[pivot * size + other];
+			matrix[pivot * size + other] = swap;
+		}
+		swap = vector[column];
+		vector[column] = vector[pivot];
+		vector[pivot] = swap;
+
+		for (row = 0; row < size; row++)
+		{
+			if (row == column)
+				continue;
+
+			factor = matrix[row * size + column] / matrix[column * size + column];
+			for (other = column; other < size; other++)
+				matrix[row * size + other] -= factor * matrix[column * size + other];
+			vector[row] -= factor * vector[column];
+		}
+	}
+
+	for (row = 0; row < size; row++)
+		vector[row] /= matrix[row * size + row];
+
+	return 0;
+}
+
+/*
+write every setting of the timing model (and the board) in the format read by --profile
+*/
+
+static int write_profile(const char *name)
+{
+	FILE *handle;
+	unsigned index;
+	double header_cost;
+
+	handle = fopen(name, "w");
+	if (NULL == handle)
+		return -1;
+
+	fprintf(handle, "# calibrated by ldrshrink --calibrate\n");
+
+	for (index = 0; index < sizeof(profile_table) / sizeof(profile_table[0]); index++)
+		fprintf(handle, "%-20s %g\n", profile_table[index].name, *profile_table[index].value);
+
+	/* the FILL block size at which a block header costs as much as unrolling it, which is what --smallest-fill-block is for */
+	header_cost = options.model.header_us + options.model.handshake_us + options.model.host_transfer_us;
+	if (options.model.byte_ns > options.model.fill_ns)
+		fprintf(handle, "# suggested --smallest-fill-block=%.0f\n", header_cost * 1000.0 / (options.model.byte_ns - options.model.fill_ns));
+
+	fclose(handle);
+
+	return 0;
+}
+
+/*
+A logic analyzer capture of the boot, as exported (CSV) by a protocol analyzer such as Saleae's: one row per byte, with a column
+for its time in seconds and one for its value.  For SPI, the bytes are those the flash returns (MISO); for UART, those received.
+Each block header of the input image is then found in the captured bytes in turn, which gives the measured time of each block:
+from its header to the next, split into the bytes being transferred and the time the Boot ROM was busy before the next header.
+*/
+
+#define CAPTURE_TOLERANCE 0.25 /* measured and modelled times of a block that differ by more than this are flagged */
+
+struct capture_block_type
+{
+	struct block_header_type hdr;
+	unsigned offset;
+	double model_us;
+};
+
+static struct
+{
+	unsigned count, allocated;
+	double *times;
+	unsigned char *bytes;
+	unsigned block_count, block_allocated;
+	struct capture_block_type *blocks;
+} capture;
+
+static int load_capture(const char *name)
+{
+	static const char *const time_names[] = { "time", "start_time", NULL };
+	static const char *const spi_names[] = { "miso", NULL };
+	static const char *const uart_names[] = { "value", "data", NULL };
+	FILE *handle;
+	char line[1024], *cursor, *field;
+	int time_column, data_column, column;
+	double time;
+	unsigned long value;
+
+	if (strcmp(options.capture_format, "spi") && strcmp(options.capture_format, "uart"))
+		return -1;
+
+	handle = fopen(name, "r");
+	if (NULL == handle)
+		return -1;
+
+	/* the heading names the columns */
+	if (!fgets(line, sizeof(line), handle))
+	{
+		fclose(handle);
+		return -1;
+	}
+
+	time_column = capture_column(line, time_names);
+	data_column = capture_column(line, strcmp(options.capture_format, "spi") ? uart_names : spi_names);
+
+	if ( (time_column < 0) || (data_column < 0) )
+	{
+		fprintf(stderr, "ERROR: capture file has no time or data column\n");
+		fclose(handle);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), handle))
+	{
+		time = -1.0;
+		value = 0x100;
+
+		for (cursor = line, column = 0; cursor; column++)
+		{
+			field = csv_field(&cursor);
+
+			if (column == time_column)
+				time = strtod(field, NULL);
+			else if ( (column == data_column) && *field )
+				value = strtoul(field, NULL, 0);
+		}
+
+		if ( (time < 0.0) || (value > 0xFF) )
+			continue;
+
+		if (capture.count == capture.allocated)
+		{
+			capture.allocated = 2 * capture.allocated + 4096;
+			capture.times = (double *)realloc(capture.times, capture.allocated * sizeof(double));
+			capture.bytes = (unsigned char *)realloc(capture.bytes, capture.allocated);
+		}
+
+		capture.times[capture.count] = time;
+		capture.bytes[capture.count] = (unsigned char)value;
+		capture.count++;
+	}
+
+	fclose(handle);
+
+	return 0;
+}
+
+/*
+which column of the heading has one of the names (ignoring case and anything after a space, as in "Time [s]")
+*/
+
+static int capture_column(char *line, const char *const *names)
+{
+	char heading[1024], *cursor, *field;
+	unsigned index, length;
+	int column;
+
+	snprintf(heading, sizeof(heading), "%s", line);
+
+	for (cursor = heading, column = 0; cursor; column++)
+	{
+		field = csv_field(&cursor);
+
+		for (length = 0; field[length] && (' ' != field[length]); length++)
+			field[length] = tolower((unsigned char)field[length]);
+
+		for (index = 0; names[index]; index++)
+			if ( (strlen(names[index]) == length) && !strncmp(field, names[index], length) )
+				return column;
+	}
+
+	return -1;
+}
+
+/*
+the next comma-separated field (without quotes or the line ending), advancing the cursor past it; NULL is left at the end of the line
+*/
+
+static char *csv_field(char **line)
+{
+	char *field, *end;
+
+	field = *line;
+	while (' ' == *field)
+		field++;
+
+	if ('"' == *field)
+	{
+		field++;
+		end = strchr(field, '"');
+		if (end)
+			*end++ = '\0';
+		else
+			end = field + strlen(field);
+	}
+	else
+	{
+		end = field;
+	}
+
+	end = end + strcspn(end, ",\r\n");
+	*line = (',' == *end) ? end + 1 : NULL;
+	*end = '\0';
+
+	return field;
+}
+
+static void capture_block(const struct block_header_type *hdr, unsigned offset, double start_us, const struct block_cost_type *cost)
+{
+	(void)start_us;
+
+	if (capture.block_count == capture.block_allocated)
+	{
+		capture.block_allocated = 2 * capture.block_allocated + 64;
+		capture.blocks = (struct capture_block_type *)realloc(capture.blocks, capture.block_allocated * sizeof(struct capture_block_type));
+	}
+
+	capture.blocks[capture.block_count].hdr = *hdr;
+	capture.blocks[capture.block_count].offset = offset;
+	capture.blocks[capture.block_count].model_us = cost->total_us;
+	capture.block_count++;
+}
+
+static void compare_capture(const unsigned char *data, unsigned length)
+{
+	unsigned *found, block, position, index, header, last;
+	double measured, transfer, measured_total, model_total;
+
+	capture.block_count = 0;
+	estimate_stream(data, length, capture_block);
+
+	header = options.format->header_size;
+	found = (unsigned *)malloc((capture.block_count + 1) * sizeof(unsigned));
+
+	/* find each block header in turn; whatever comes between (e.g. SPI commands and addresses) is passed over */
+	for (block = 0, position = 0; block < capture.block_count; block++)
+	{
+		for (index = position; index + header <= capture.count; index++)
+			if (!memcmp(capture.bytes + index, data + capture.blocks[block].offset, header))
+				break;
+
+		if (index + header > capture.count)
+			break;
+
+		found[block] = index;
+		position = index + header;
+	}
+
+	fprintf(options.listing, "--- measured boot (%s capture, %u bytes)\n", options.capture_format, capture.count);
+
+	if (block < capture.block_count)
+		fprintf(stderr, "WARNING: block at offset 0x%x not found in the capture; only %u of %u blocks are compared\n",
+		        capture.blocks[block].offset, block, capture.block_count);
+
+	/* the last block found ends with the last byte captured */
+	found[block] = capture.count;
+	measured_total = model_total = 0.0;
+
+	for (index = 0; index < block; index++)
+	{
+		last = found[index + 1] - 1;
+		transfer = 1e6 * (capture.times[last] - capture.times[found[index]]);
+		measured = (index + 1 < block) ? 1e6 * (capture.times[found[index + 1]] - capture.times[found[index]]) : transfer;
+
+		/* blocks that the model gets wrong are marked with a '!' */
+		fprintf(options.listing, "%c%8.1f us measured (%.1f transfer, %.1f busy); %8.1f us model; @0x%x 0x%x 0x%x",
+		       (fabs(measured - capture.blocks[index].model_us) > CAPTURE_TOLERANCE * capture.blocks[index].model_us) ? '!' : ' ',
+		       measured, transfer, measured - transfer, capture.blocks[index].model_us,
+		       capture.blocks[index].offset, capture.blocks[index].hdr.target_address, capture.blocks[index].hdr.byte_count);
+		print_flags(capture.blocks[index].hdr.block_code.flags, capture.blocks[index].hdr.argument);
+
+		measured_total += measured;
+		model_total += capture.blocks[index].model_us;
+	}
+
+	fprintf(options.listing, "measured %.0f us; model %.0f us\n", measured_total, model_total);
+
+	free(found);
+}
+
+/*
+A raw flash dump may hold several loader streams (e.g. A/B slots and a recovery image) among unrelated data.  Every byte
+matching the header signature is a possible header; it is only taken as the start of a stream if the header checksum
+passes, it is a First Block, and the chain of headers that follows it is intact all the way to a Final Block.
+
+memchr() does the searching (the C library vectorizes it), with the dump divided among several threads.
+*/
+
+static int scan_dump(const char *name)
+{
+	const unsigned char *dump;
+	unsigned long long dump_length;
+	struct stream_type *streams;
+	unsigned thread_count, count, index;
+	char file_name[1024];
+	FILE *handle;
+
+	dump = map_file(name, &dump_length);
+
+	if (NULL == dump)
+		return -1;
+
+	thread_count = scan_threads();
+	streams = find_streams(dump, dump_length, thread_count, &count);
+
+	if (options.verbosity >= 1)
+		printf("--- scan of %s (%llu bytes, %u threads)\n", name, dump_length, thread_count);
+
+	for (index = 0; index < count; index++)
+	{
+		printf("0x%08llx 0x%llx bytes, %u blocks, %u application%s, entry 0x%x",
+		       streams[index].offset, streams[index].length, streams[index].blocks,
+		       streams[index].applications, (streams[index].applications == 1) ? "" : "s", streams[index].entry_point);
+
+		if (options.extract_prefix)
+		{
+			snprintf(file_name, sizeof(file_name), "%s-%08llx.ldr", options.extract_prefix, streams[index].offset);
+			printf(" -> %s", file_name);
+
+			handle = fopen(file_name, "wb");
+			if ( (NULL == handle) || (fwrite(dump + streams[index].offset, 1, streams[index].length, handle) != streams[index].length) )
+			{
+				printf("\n");
+				fprintf(stderr, "ERROR: unable to write %s\n", file_name);
+				if (handle)
+					fclose(handle);
+				free(streams);
+				unmap_file(dump, dump_length);
+				return -1;
+			}
+			fclose(handle);
+		}
+
+		printf("\n");
+	}
+
+	if (options.verbosity >= 1)
+		printf("%u loader stream%s found\n", count, (count == 1) ? "" : "s");
+
+	free(streams);
+	unmap_file(dump, dump_length);
+
+	return 0;
+}
+
+static unsigned scan_threads(void)
+{
+	unsigned thread_count;
+#ifndef _WIN32
+	long online;
+#endif
+
+	thread_count = options.threads;
+#ifndef _WIN32
+	if (!thread_count)
+	{
+		online = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = (online > 0) ? (unsigned)online : 1;
+	}
+#else
+	thread_count = 1; /* no threads on Windows; the scan is still bounded by memchr() */
+#endif
+	if (thread_count > MAX_SCAN_THREADS)
+		thread_count = MAX_SCAN_THREADS;
+	if (!thread_count)
+		thread_count = 1;
+
+	return thread_count;
+}
+
+/* every intact loader stream in the dump, in order of offset */
+static struct stream_type *find_streams(const unsigned char *dump, unsigned long long dump_length, unsigned thread_count, unsigned *count)
+{
+	unsigned long long end, slice;
+	struct scan_job_type jobs[MAX_SCAN_THREADS];
+	struct stream_type *streams, stream;
+	unsigned thread, index, allocated;
+#ifndef _WIN32
+	pthread_t threads[MAX_SCAN_THREADS];
+#endif
+
+	/* the ranges are of the signature byte, so a header straddling two ranges is found by whichever holds its signature */
+	slice = (dump_length + thread_count - 1) / thread_count;
+	memset(jobs, 0, sizeof(jobs));
+
+	for (thread = 0; thread < thread_count; thread++)
+	{
+		jobs[thread].dump = dump;
+		jobs[thread].dump_length = dump_length;
+		jobs[thread].start = thread * slice;
+		jobs[thread].end = (thread + 1) * slice;
+		if (jobs[thread].start > dump_length)
+			jobs[thread].start = dump_length;
+		if (jobs[thread].end > dump_length)
+			jobs[thread].end = dump_length;
+	}
+
+#ifndef _WIN32
+	for (thread = 1; thread < thread_count; thread++)
+		if (pthread_create(&threads[thread], NULL, scan_range, &jobs[thread]))
+			break;
+
+	/* this thread takes the first range, as well as any that a thread could not be created for */
+	scan_range(&jobs[0]);
+	for (index = thread; index < thread_count; index++)
+		scan_range(&jobs[index]);
+
+	for (index = 1; index < thread; index++)
+		pthread_join(threads[index], NULL);
+#else
+	for (thread = 0; thread < thread_count; thread++)
+		scan_range(&jobs[thread]);
+#endif
+
+	/* the ranges are in order, so the candidates are too; a candidate inside a stream already found is part of it */
+	streams = NULL;
+	*count = allocated = 0;
+	end = 0;
+
+	for (thread = 0; thread < thread_count; thread++)
+	{
+		allocation_count += jobs[thread].allocations;
+
+		for (index = 0; index < jobs[thread].count; index++)
+		{
+			if (jobs[thread].candidates[index] < end)
+				continue;
+
+			if (follow_stream(dump, dump_length, jobs[thread].candidates[index], &stream))
+				continue;
+
+			if (*count == allocated)
+			{
+				allocated = allocated ? 2 * allocated : 16;
+				streams = (struct stream_type *)realloc(streams, allocated * sizeof(struct stream_type));
+			}
+
+			streams[(*count)++] = stream;
+			end = stream.offset + stream.length;
+		}
+
+		free(jobs[thread].candidates);
+	}
+
+	return streams;
+}
+
+static void *scan_range(void *argument)
+{
+	struct scan_job_type *job = (struct scan_job_type *)argument;
+	const unsigned char *sign, *end;
+	struct block_header_type hdr;
+	unsigned long long offset;
+
+	sign = job->dump + job->start;
+	end = job->dump + job->end;
+
+	while ( (sign < end) && (NULL != (sign = (const unsigned char *)memchr(sign, BLOCK_HDRSIGN, end - sign))) )
+	{
+		offset = (unsigned long long)(sign - job->dump);
+		sign++;
+
+		/* the signature is the last byte of the block code, the first word of the header */
+		if ( (offset < 3) || (offset - 3 + sizeof(struct block_header_type) > job->dump_length) )
+			continue;
+
+		offset -= 3;
+
+		/* a stream with no blocks at all (a First Block that is also the Final Block) is taken to be noise */
+		if (read_header_v2(job->dump + offset, &hdr) || ((hdr.block_code.flags & (BFLAG_FIRST | BFLAG_FINAL)) != BFLAG_FIRST))
+			continue;
+
+		if (job->count == job->allocated)
+		{
+			/* not through the counting realloc(), which is not thread-safe; the allocations are added up afterwards */
+			job->allocated = job->allocated ? 2 * job->allocated : 64;
+			job->candidates = (unsigned long long *)(realloc)(job->candidates, job->allocated * sizeof(unsigned long long));
+			job->allocations++;
+		}
+
+		job->candidates[job->count++] = offset;
+	}
+
+	return NULL;
+}
+
+/* walk the chain of headers from a First Block to the Final Block, as the parser would; non-zero if it is broken */
+static int follow_stream(const unsigned char *dump, unsigned long long dump_length, unsigned long long offset, struct stream_type *stream)
+{
+	struct block_header_type hdr;
+	unsigned long long position;
+
+	memset(stream, 0, sizeof(struct stream_type));
+	stream->offset = offset;
+
+	for (position = offset; position + sizeof(struct block_header_type) <= dump_length; )
+	{
+		if ( (dump[position + 3] != BLOCK_HDRSIGN) || read_header_v2(dump + position, &hdr) )
+			return -1;
+
+		if ( (position == offset) && !(hdr.block_code.flags & BFLAG_FIRST) )
+			return -1;
+
+		position += sizeof(struct block_header_type);
+		stream->blocks++;
+
+		if (hdr.block_code.flags & BFLAG_FINAL)
+		{
+			stream->length = position - offset;
+			return 0;
+		}
+
+		if (hdr.block_code.flags & BFLAG_FIRST)
+		{
+			if (!stream->applications++)
+				stream->entry_point = hdr.target_address;
+			continue;
+		}
+
+		if (hdr.block_code.flags & BFLAG_FILL)
+			continue;
+
+		if (hdr.byte_count > dump_length - position)
+			return -1;
+
+		position += hdr.byte_count;
+	}
+
+	return -1;
+}
+
+/*
+a dump may be far larger than memory, so it is mapped rather than read; Windows falls back to reading it (up to 4GB)
+*/
+static const unsigned char *map_file(const char *name, unsigned long long *length)
+{
+#ifndef _WIN32
+	struct stat status;
+	void *data;
+	int handle;
+
+	handle = open(name, O_RDONLY);
+	if (handle < 0)
+		return NULL;
+
+	if (fstat(handle, &status) || !status.st_size)
+	{
+		close(handle);
+		return NULL;
+	}
+
+	data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, handle, 0);
+	close(handle);
+
+	if (MAP_FAILED == data)
+		return NULL;
+
+	madvise(data, status.st_size, MADV_SEQUENTIAL);
+	*length = status.st_size;
+
+	return (const unsigned char *)data;
+#else
+	unsigned char *data;
+	unsigned size;
+
+	data = load_file(name, &size);
+	*length = size;
+
+	return data;
+#endif
+}
+
+static void unmap_file(const unsigned char *data, unsigned long long length)
+{
+#ifndef _WIN32
+	munmap((void *)data, length);
+#else
+	(void)length;
+	free((void *)data);
+#endif
+}
+
+/*
+Find the loader stream in a flash image, at --flash-offset or, with --flash-offset=auto, by scanning for it, and return a copy of it.
+*/
+static unsigned char *embedded_stream(unsigned char *flash, unsigned flash_length, struct stream_type *stream, unsigned *length)
+{
+	struct stream_type *streams;
+	unsigned long long offset;
+	unsigned char *data;
+	unsigned count, index;
+	char *end;
+
+	if (!strcmp(options.flash_offset, "auto"))
+	{
+		streams = find_streams(flash, flash_length, scan_threads(), &count);
+
+		if (1 != count)
+		{
+			fprintf(stderr, "ERROR: %u loader streams found in the flash image; choose one with --flash-offset\n", count);
+			for (index = 0; index < count; index++)
+				fprintf(stderr, "  0x%llx (0x%llx bytes)\n", streams[index].offset, streams[index].length);
+			free(streams);
+			return NULL;
+		}
+
+		*stream = streams[0];
+		free(streams);
+	}
+	else
+	{
+		offset = strtoull(options.flash_offset, &end, 0);
+
+		if (*end || follow_stream(flash, flash_length, offset, stream))
+		{
+			fprintf(stderr, "ERROR: no intact loader stream at --flash-offset=%s\n", options.flash_offset);
+			return NULL;
+		}
+	}
+
+	data = (unsigned char *)malloc(stream->length);
+	memcpy(data, flash + stream->offset, stream->length);
+	*length = stream->length;
+
+	return data;
+}
+
+/*
+With --reference, the previous output image is taken as the layout to keep to.  The chunks of each segment are written in the order
+that the reference has them, and a chunk identical to a block of the reference is padded out (with an Ignore Block) to the offset
+that the block had, provided that the padding is no more than a sector.  Everything after it then lines up again, so a small change
+in the firmware rewrites only the flash sectors around it.
+*/
+
+static int load_reference(const char *name)
+{
+	reference.data = load_file(name, &reference.length);
+
+	if (NULL == reference.data)
+		return -1;
+
+	estimate_stream(reference.data, reference.length, reference_block);
+	qsort(reference.blocks, reference.count, sizeof(struct reference_block_type), compare_reference_block);
+
+	return 0;
+}
+
+static void reference_block(const struct block_header_type *hdr, unsigned offset, double start_us, const struct block_cost_type *cost)
+{
+	(void)start_us;
+	(void)cost;
+
+	/* only blocks that load something are worth keeping in place */
+	if (hdr->block_code.flags & (BFLAG_FIRST | BFLAG_IGNORE))
+		return;
+	if ( (hdr->block_code.flags & BFLAG_FINAL) && !options.format->final_has_payload )
+		return;
+
+	if (reference.count == reference.allocated)
+	{
+		reference.allocated = reference.allocated ? 2 * reference.allocated : 64;
+		reference.blocks = (struct reference_block_type *)realloc(reference.blocks, reference.allocated * sizeof(struct reference_block_type));
+	}
+
+	reference.blocks[reference.count].hdr = *hdr;
+	reference.blocks[reference.count].offset = offset;
+	reference.blocks[reference.count].order = reference.count;
+	reference.blocks[reference.count].used = 0;
+	reference.count++;
+}
+
+static int compare_reference_block(const void *a, const void *b)
+{
+	const struct reference_block_type *block_a = (const struct reference_block_type *)a;
+	const struct reference_block_type *block_b = (const struct reference_block_type *)b;
+
+	if (block_a->hdr.target_address != block_b->hdr.target_address)
+		return (block_a->hdr.target_address < block_b->hdr.target_address) ? -1 : 1;
+	if (block_a->offset != block_b->offset)
+		return (block_a->offset < block_b->offset) ? -1 : 1;
+	return 0;
+}
+
+/* index of the first block of the reference with a target address no lower than address */
+static unsigned reference_lower_bound(unsigned address)
+{
+	unsigned low, high, middle;
+
+	low = 0;
+	high = reference.count;
+
+	while (low < high)
+	{
+		middle = low + (high - low) / 2;
+		if (reference.blocks[middle].hdr.target_address < address)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+/* where the reference first loads the chunk's address; chunks that it does not go last */
+static unsigned reference_rank(const struct chunk_list_type *chunk)
+{
+	unsigned index;
+
+	index = reference_lower_bound(chunk->address);
+
+	if ( (index < reference.count) && (reference.blocks[index].hdr.target_address == chunk->address) )
+		return reference.blocks[index].order;
+
+	return ~0U;
+}
+
+/* the padding that puts the chunk where the reference has an identical block, or -1 if there is none in reach */
+static int reference_padding(unsigned offset, const struct chunk_list_type *chunk)
+{
+	struct reference_block_type *block;
+	unsigned index, gap;
+
+	for (index = reference_lower_bound(chunk->address); (index < reference.count) && (reference.blocks[index].hdr.target_address == chunk->address); index++)
+	{
+		block = &reference.blocks[index];
+
+		if (block->used || (block->offset < offset))
+			continue;
+		if ( (block->hdr.byte_count != chunk->length) || (block->hdr.block_code.flags != chunk->flags) || (block->hdr.argument != chunk->argument) )
+			continue;
+		if (chunk->data && memcmp(reference.data + block->offset + options.format->header_size, chunk->data, chunk->length))
+			continue;
+
+		/* an Ignore Block cannot be smaller than its header, and more than a sector of padding costs more boot time than it saves */
+		gap = block->offset - offset;
+		if ( gap && ((gap < options.format->header_size) || (gap > options.sector_size) || (gap > options.size_slack)) )
+			return -1;
+
+		block->used = 1;
+		reference.kept++;
+
+		return gap;
+	}
+
+	return -1;
+}
+
+/*
+put the chunks in the order of the reference, as far as they can be moved past one another; a chunk is never moved past one that it
+overlaps, nor past a barrier
+*/
+
+static struct chunk_list_type *follow_reference(struct chunk_list_type *list)
+{
+	struct chunk_list_type *sorted, *chunk, *other, **after;
+
+	for (chunk = list; chunk; chunk = chunk->next)
+		chunk->mark = reference_rank(chunk);
+
+	sorted = NULL;
+
+	while (list)
+	{
+		chunk = list;
+		list = list->next;
+
+		/* insert it after the last chunk that has to stay ahead of it */
+		after = &sorted;
+		for (other = sorted; other; other = other->next)
+			if ( (other->mark <= chunk->mark) || is_barrier(chunk) || is_barrier(other) ||
+			     ranges_overlap(chunk->address, chunk->length, other->address, other->length) )
+				after = &other->next;
+
+		chunk->next = *after;
+		*after = chunk;
+	}
+
+	return sorted;
+}
+
+static void compare_reference(const unsigned char *data, unsigned length)
+{
+	unsigned changed, sectors;
+
+	changed = changed_sectors(data, length, reference.data, reference.length, &sectors);
+
+	fprintf(options.listing, "--- reference: %u of %u blocks at the same offset; %u of %u sectors (0x%x bytes) changed\n",
+	       reference.kept, reference.count, changed, sectors, options.sector_size);
+}
+
+/* how many flash sectors an update from the old image to the new has to rewrite; space beyond either image is taken as erased */
+static unsigned changed_sectors(const unsigned char *new_data, unsigned new_length, const unsigned char *old_data, unsigned old_length, unsigned *sectors)
+{
+	unsigned sector, changed, index;
+	unsigned char new_byte, old_byte;
+
+	*sectors = ((new_length > old_length ? new_length : old_length) + options.sector_size - 1) / options.sector_size;
+	changed = 0;
+
+	for (sector = 0; sector < *sectors; sector++)
+	{
+		index = sector * options.sector_size;
+
+		/* a sector that is within both images can be compared all at once */
+		if ( (index + options.sector_size <= new_length) && (index + options.sector_size <= old_length) )
+		{
+			if (memcmp(new_data + index, old_data + index, options.sector_size))
+				changed++;
+			continue;
+		}
+
+		for (index = sector * options.sector_size; index < (sector + 1) * options.sector_size; index++)
+		{
+			new_byte = (index < new_length) ? new_data[index] : 0xFF;
+			old_byte = (index < old_length) ? old_data[index] : 0xFF;
+			if (new_byte != old_byte)
+				break;
+		}
+
+		if (index < (sector + 1) * options.sector_size)
+			changed++;
+	}
+
+	return changed;
+}
+
+/*
+--diff compares two loader images: the memory that each leaves behind (changed, added and removed address ranges), their blocks (a
+block of the new image that is identical to one of the old, header and payload, is unchanged if it is at the same offset and moved if
+not), and the flash sectors of --sector-size that differ.  Blocks are matched by a hash of their contents, and memory is compared a
+page at a time without ever being copied out of the two images.
+*/
+
+static int diff_images(const char *old_name, const char *new_name)
+{
+	struct stream_image_type old_image, new_image;
+	unsigned long long memory[3];
+	unsigned blocks[4], changed, sectors;
+
+	if (!options.sector_size)
+		return -1;
+
+	if (load_stream_image(old_name, &old_image) || load_stream_image(new_name, &new_image))
+		return -1;
+
+	printf("--- memory\n");
+	memset(memory, 0, sizeof(memory));
+	diff_memory(&old_image, &new_image, memory);
+
+	printf("--- blocks\n");
+	memset(blocks, 0, sizeof(blocks));
+	diff_blocks(&old_image, &new_image, blocks);
+
+	changed = changed_sectors(new_image.data, new_image.length, old_image.data, old_image.length, &sectors);
+
+	printf("---\n%llu bytes of memory changed, %llu added, %llu removed\n", memory[0], memory[1], memory[2]);
+	printf("%u blocks unchanged, %u moved, %u changed or added, %u removed\n", blocks[0], blocks[1], blocks[2], blocks[3]);
+	printf("%u of %u sectors (0x%x bytes) changed\n", changed, sectors, options.sector_size);
+
+	free(old_image.pieces);
+	free(new_image.pieces);
+	free(old_image.blocks);
+	free(new_image.blocks);
+	if (old_image.mapped)
+		unmap_file(old_image.data, old_image.length);
+	else
+		free((void *)old_image.data);
+	if (new_image.mapped)
+		unmap_file(new_image.data, new_image.length);
+	else
+		free((void *)new_image.data);
+
+	return 0;
+}
+
+static int load_stream_image(const char *name, struct stream_image_type *image)
+{
+	unsigned long long length;
+	unsigned char *data;
+
+	memset(image, 0, sizeof(struct stream_image_type));
+
+	/* a binary image is mapped rather than read, as nothing is copied out of it */
+	image->data = map_file(name, &length);
+	if (NULL == image->data)
+		return -1;
+
+	image->mapped = 1;
+	image->length = (unsigned)length;
+
+	if (length > ~0U)
+		return -1;
+
+	if ( strcmp(options.input_format, "binary") && (strcmp(options.input_format, "auto") || is_text(image->data, image->length)) )
+	{
+		data = (unsigned char *)malloc(image->length);
+		memcpy(data, image->data, image->length);
+		unmap_file(image->data, length);
+		image->mapped = 0;
+
+		image->data = data = decode_input(data, &image->length);
+		if (NULL == data)
+			return -1;
+	}
+
+	diff_image = image;
+	estimate_stream(image->data, image->length, diff_block);
+	resolve_pieces(image);
+
+	return 0;
+}
+
+static void diff_block(const struct block_header_type *hdr, unsigned offset, double start_us, const struct block_cost_type *cost)
+{
+	struct stream_block_type *block;
+	struct piece_type *piece;
+	const unsigned char *payload;
+	unsigned long long hash;
+	unsigned fields[4];
+
+	(void)start_us;
+	(void)cost;
+
+	if (hdr->block_code.flags & (BFLAG_FIRST | BFLAG_IGNORE))
+		return;
+	if ( (hdr->block_code.flags & BFLAG_FINAL) && !options.format->final_has_payload )
+		return;
+
+	payload = diff_image->data + offset + options.format->header_size;
+	if ( !(hdr->block_code.flags & BFLAG_FILL) && (hdr->byte_count > diff_image->length - (offset + options.format->header_size)) )
+		return; /* truncated */
+
+	if (hdr->byte_count)
+	{
+		if (diff_image->piece_count == diff_image->pieces_allocated)
+		{
+			diff_image->pieces_allocated = diff_image->pieces_allocated ? 2 * diff_image->pieces_allocated : 64;
+			diff_image->pieces = (struct piece_type *)realloc(diff_image->pieces, diff_image->pieces_allocated * sizeof(struct piece_type));
+		}
+
+		piece = &diff_image->pieces[diff_image->piece_count];
+		piece->address = piece->base = hdr->target_address;
+		piece->end = (unsigned long long)hdr->target_address + hdr->byte_count;
+		piece->data = (hdr->block_code.flags & BFLAG_FILL) ? NULL : payload;
+		memcpy(piece->fill, &hdr->argument, sizeof(piece->fill));
+		piece->order = diff_image->piece_count++;
+	}
+
+	fields[0] = hdr->target_address;
+	fields[1] = hdr->byte_count;
+	fields[2] = hdr->block_code.flags;
+	fields[3] = hdr->argument;
+	hash = hash_bytes(0xCBF29CE484222325ULL, fields, sizeof(fields));
+	if (!(hdr->block_code.flags & BFLAG_FILL))
+		hash = hash_bytes(hash, payload, hdr->byte_count);
+
+	if (diff_image->count == diff_image->allocated)
+	{
+		diff_image->allocated = diff_image->allocated ? 2 * diff_image->allocated : 64;
+		diff_image->blocks = (struct stream_block_type *)realloc(diff_image->blocks, diff_image->allocated * sizeof(struct stream_block_type));
+	}
+
+	block = &diff_image->blocks[diff_image->count++];
+	block->hdr = *hdr;
+	block->offset = offset;
+	block->hash = hash;
+	block->matched = 0;
+}
+
+/* FNV-1a, but a word at a time rather than a byte, as payloads can be hundreds of MB */
+static unsigned long long hash_bytes(unsigned long long hash, const void *data, unsigned length)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	unsigned long long word;
+	unsigned index;
+
+	for (index = 0; index + sizeof(word) <= length; index += sizeof(word))
+	{
+		memcpy(&word, bytes + index, sizeof(word));
+		hash ^= word;
+		hash *= 0x100000001B3ULL;
+		hash ^= hash >> 29;
+	}
+
+	for (; index < length; index++)
+	{
+		hash ^= bytes[index];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+static int compare_stream_block(const void *a, const void *b)
+{
+	const struct stream_block_type *block_a = *(const struct stream_block_type *const *)a;
+	const struct stream_block_type *block_b = *(const struct stream_block_type *const *)b;
+
+	if (block_a->hash != block_b->hash)
+		return (block_a->hash < block_b->hash) ? -1 : 1;
+	if (block_a->offset != block_b->offset)
+		return (block_a->offset < block_b->offset) ? -1 : 1;
+	return 0;
+}
+
+/*
+sort the pieces by address and cut away whatever a later block overwrites; where blocks overlap, each stretch between the ends of any
+of them belongs to the last one written to it
+*/
+
+static void resolve_pieces(struct stream_image_type *image)
+{
+	struct piece_type *sorted, *resolved;
+	unsigned long long cluster_end, *bounds, low, high;
+	unsigned first, last, count, bound_count, index, bound, top;
+
+	sorted = image->pieces;
+	qsort(sorted, image->piece_count, sizeof(struct piece_type), compare_piece);
+
+	/* a cluster of n overlapping pieces has at most 2n - 1 stretches */
+	resolved = (struct piece_type *)malloc((2 * image->piece_count + 1) * sizeof(struct piece_type));
+	bounds = (unsigned long long *)malloc((2 * image->piece_count + 1) * sizeof(unsigned long long));
+	count = 0;
+
+	for (first = 0; first < image->piece_count; first = last + 1)
+	{
+		cluster_end = sorted[first].end;
+		for (last = first; (last + 1 < image->piece_count) && (sorted[last + 1].address < cluster_end); last++)
+			if (sorted[last + 1].end > cluster_end)
+				cluster_end = sorted[last + 1].end;
+
+		if (first == last)
+		{
+			resolved[count++] = sorted[first];
+			continue;
+		}
+
+		bound_count = 0;
+		for (index = first; index <= last; index++)
+		{
+			bounds[bound_count++] = sorted[index].address;
+			bounds[bound_count++] = sorted[index].end;
+		}
+		qsort(bounds, bound_count, sizeof(unsigned long long), compare_bound);
+
+		for (bound = 0; bound + 1 < bound_count; bound++)
+		{
+			low = bounds[bound];
+			high = bounds[bound + 1];
+			if (low == high)
+				continue;
+
+			top = last + 1;
+			for (index = first; index <= last; index++)
+				if ( (sorted[index].address <= low) && (sorted[index].end >= high) && ((top > last) || (sorted[index].order > sorted[top].order)) )
+					top = index;
+
+			if ( count && (resolved[count - 1].order == sorted[top].order) && (resolved[count - 1].end == low) )
+			{
+				resolved[count - 1].end = high;
+			}
+			else
+			{
+				resolved[count] = sorted[top];
+				resolved[count].address = low;
+				resolved[count].end = high;
+				count++;
+			}
+		}
+	}
+
+	free(bounds);
+	free(sorted);
+	image->pieces = resolved;
+	image->piece_count = count;
+}
+
+static int compare_piece(const void *a, const void *b)
+{
+	const struct piece_type *piece_a = (const struct piece_type *)a;
+	const struct piece_type *piece_b = (const struct piece_type *)b;
+
+	if (piece_a->address != piece_b->address)
+		return (piece_a->address < piece_b->address) ? -1 : 1;
+	if (piece_a->order != piece_b->order)
+		return (piece_a->order < piece_b->order) ? -1 : 1;
+	return 0;
+}
+
+static int compare_bound(const void *a, const void *b)
+{
+	unsigned long long bound_a = *(const unsigned long long *)a;
+	unsigned long long bound_b = *(const unsigned long long *)b;
+
+	return (bound_a < bound_b) ? -1 : (bound_a > bound_b);
+}
+
+static unsigned char piece_byte(const struct piece_type *piece, unsigned long long address)
+{
+	if (piece->data)
+		return piece->data[address - piece->base];
+
+	return piece->fill[(address - piece->base) & 3];
+}
+
+/*
+walk the two memory images together; totals are the bytes changed, added and removed
+*/
+
+static void diff_memory(struct stream_image_type *old_image, struct stream_image_type *new_image, unsigned long long *totals)
+{
+	const unsigned long long none = 1ULL << 33; /* beyond any address */
+	unsigned long long cursor, old_low, old_high, new_low, new_high, end;
+	const struct piece_type *old_piece, *new_piece;
+	unsigned old_index, new_index;
+	int in_old, in_new;
+
+	cursor = 0;
+	old_index = new_index = 0;
+
+	while ( (old_index < old_image->piece_count) || (new_index < new_image->piece_count) )
+	{
+		old_piece = (old_index < old_image->piece_count) ? &old_image->pieces[old_index] : NULL;
+		new_piece = (new_index < new_image->piece_count) ? &new_image->pieces[new_index] : NULL;
+
+		old_low = old_piece ? old_piece->address : none;
+		old_high = old_piece ? old_piece->end : none;
+		new_low = new_piece ? new_piece->address : none;
+		new_high = new_piece ? new_piece->end : none;
+
+		if (cursor < (old_low < new_low ? old_low : new_low))
+			cursor = (old_low < new_low ? old_low : new_low);
+
+		in_old = (old_low <= cursor);
+		in_new = (new_low <= cursor);
+		end = in_old ? old_high : old_low;
+		if ((in_new ? new_high : new_low) < end)
+			end = in_new ? new_high : new_low;
+
+		if (in_old && in_new)
+		{
+			diff_pieces(old_piece, new_piece, cursor, end, totals);
+		}
+		else if (in_old)
+		{
+			report_range(2, cursor, end);
+			totals[2] += end - cursor;
+		}
+		else
+		{
+			report_range(1, cursor, end);
+			totals[1] += end - cursor;
+		}
+
+		cursor = end;
+		if (old_piece && (cursor >= old_high))
+			old_index++;
+		if (new_piece && (cursor >= new_high))
+			new_index++;
+	}
+
+	report_range(-1, 0, 0);
+}
+
+static void diff_pieces(const struct piece_type *old_piece, const struct piece_type *new_piece, unsigned long long low, unsigned long long high, unsigned long long *totals)
+{
+	unsigned long long page, last, address;
 
-	if (argc < 3)
+	/* two fills repeat every four bytes, so if the first four are the same then so are the rest */
+	if (!old_piece->data && !new_piece->data)
 	{
-		fprintf(stderr, "%s <input_ldr> <output_ldr> [entry_addr]\n", argv[0]);
-		return -1;
-	}
+		for (address = low; (address < low + 4) && (address < high); address++)
+			if (piece_byte(old_piece, address) != piece_byte(new_piece, address))
+				break;
 
-	input = fopen(argv[1], "rb");
+		if ( (address == low + 4) || (address == high) )
+			return;
+	}
 
-	if (NULL == input)
+	/* whole pages of data are compared at once, and only those that differ are gone through byte by byte */
+	for (page = low; page < high; page += DIFF_PAGE)
 	{
-		fprintf(stderr, "ERROR: unable to open input file\n");
-		return -1;
+		last = (high - page < DIFF_PAGE) ? high : page + DIFF_PAGE;
+
+		if ( old_piece->data && new_piece->data &&
+		     !memcmp(old_piece->data + (page - old_piece->base), new_piece->data + (page - new_piece->base), last - page) )
+			continue;
+
+		for (address = page; address < last; address++)
+			if (piece_byte(old_piece, address) != piece_byte(new_piece, address))
+			{
+				report_range(0, address, address + 1);
+				totals[0]++;
+			}
 	}
+}
 
-	output = fopen(argv[2], "wb");
+/* print a range, merging it with the one before if it is of the same kind and close enough; a kind of -1 flushes */
+static void report_range(int kind, unsigned long long low, unsigned long long high)
+{
+	static const char *const names[] = { "changed", "added  ", "removed" };
+	static int pending_kind = -1;
+	static unsigned long long pending_low, pending_high;
 
-	if (NULL == output)
+	if ( (kind == pending_kind) && (kind >= 0) && (low <= pending_high + (kind ? 0 : DIFF_PAGE)) )
 	{
-		fprintf(stderr, "ERROR: unable to open output file\n");
-		return -1;
+		pending_high = high;
+		return;
 	}
 
-	position = 0;
-	input_block_count = output_block_count = 0;
+	if (pending_kind >= 0)
+		printf("%s 0x%08llx-0x%08llx (0x%llx bytes)\n", names[pending_kind], pending_low, pending_high - 1, pending_high - pending_low);
+
+	pending_kind = kind;
+	pending_low = low;
+	pending_high = high;
+}
 
-	while (fread(&hdr, sizeof(struct block_header_type), 1, input))
+/*
+totals are the blocks unchanged, moved, changed (or added), and removed
+*/
+
+static void diff_blocks(struct stream_image_type *old_image, struct stream_image_type *new_image, unsigned *totals)
+{
+	struct stream_block_type *block, *other, *match, **by_hash;
+	unsigned index, low, high, middle;
+
+	/* the blocks are listed in stream order, but the old ones are looked up by hash */
+	by_hash = (struct stream_block_type **)malloc((old_image->count + 1) * sizeof(struct stream_block_type *));
+	for (index = 0; index < old_image->count; index++)
+		by_hash[index] = &old_image->blocks[index];
+	qsort(by_hash, old_image->count, sizeof(struct stream_block_type *), compare_stream_block);
+
+	for (index = 0; index < new_image->count; index++)
 	{
-		/* compute the XOR checksum */
-		checksum = calc_header_checksum(&hdr);
+		block = &new_image->blocks[index];
 
-		/* stop execution if the checksum failed; the checksum passes only when it calculates to zero */
-		if (checksum)
+		low = 0;
+		high = old_image->count;
+		while (low < high)
 		{
-			fprintf(stderr, "ERROR: checksum failed @ 0x%02x\n", position);
-			return -1;
+			middle = low + (high - low) / 2;
+			if (by_hash[middle]->hash < block->hash)
+				low = middle + 1;
+			else
+				high = middle;
 		}
 
-		/* keep track of position (and print for diagnostic purposes) */
-		position += sizeof(struct block_header_type);
-		if (!(hdr.block_code.flags & (BFLAG_FIRST | BFLAG_FINAL)))
+		/* of the identical blocks, one at the same offset is preferred */
+		match = NULL;
+		for (; (low < old_image->count) && (by_hash[low]->hash == block->hash); low++)
 		{
-			printf("0x%x 0x%x", hdr.target_address, hdr.byte_count);
-			print_flags(hdr.block_code.flags, hdr.argument);
-		}
+			other = by_hash[low];
 
-		if (hdr.block_code.flags & (BFLAG_FIRST | BFLAG_FINAL))
-			if (list)
-			{
-				write_image(output, list, &settings);
-				list = NULL;
-			}
+			if (other->matched || (other->hdr.target_address != block->hdr.target_address) || (other->hdr.byte_count != block->hdr.byte_count))
+				continue;
+			if ( !(block->hdr.block_code.flags & BFLAG_FILL) &&
+			     memcmp(old_image->data + other->offset + options.format->header_size, new_image->data + block->offset + options.format->header_size, block->hdr.byte_count) )
+				continue;
 
-		/* bail while loop if we've reached the end */
-		if (hdr.block_code.flags & BFLAG_FINAL)
-		{
-			break;
+			if (!match || (other->offset == block->offset))
+				match = other;
 		}
 
-		/* if this is a First Block, we note the entry point address and immediately loop again to read the next block */
-		if (hdr.block_code.flags & BFLAG_FIRST)
+		if (NULL == match)
 		{
-			settings.entry_point = hdr.target_address;
-			settings.hdrsign = hdr.block_code.hdrsign;
-			settings.bcode = hdr.block_code.bcode;
-			
-			printf("--- read 0x%02x entry 0x%x\n", hdr.block_code.hdrsign, hdr.target_address);
-
-			if (argc > 3) /* re-write entry address if provided with one */
-				settings.entry_point = strtoul(argv[3], NULL, 0);
-
+			print_block("changed", block);
+			totals[2]++;
 			continue;
 		}
 
-		input_block_count++;
+		match->matched = block->matched = 1;
 
-		/* if this is an Ignore Block (other than a First Block), we throw away the data */
-		if (hdr.block_code.flags & BFLAG_IGNORE)
+		if (match->offset == block->offset)
 		{
-			fseek(input, hdr.byte_count, SEEK_CUR);
-			continue;
+			totals[0]++;
+		}
+		else
+		{
+			printf("moved   @0x%x -> ", match->offset);
+			print_block("", block);
+			totals[1]++;
 		}
+	}
 
-		/* keep track of position for diagnostic purposes */
-		if (!(hdr.block_code.flags & BFLAG_FILL))
-			position += hdr.byte_count;
+	for (index = 0; index < old_image->count; index++)
+		if (!old_image->blocks[index].matched)
+		{
+			print_block("removed", &old_image->blocks[index]);
+			totals[3]++;
+		}
 
-		/* find the right place to insert the data into the linked list */
+	free(by_hash);
+}
 
-		current = list;
-		previous = NULL;
-		additional = NULL;
+static void print_block(const char *what, const struct stream_block_type *block)
+{
+	if (*what)
+		printf("%s ", what);
+	printf("@0x%x 0x%x 0x%x", block->offset, block->hdr.target_address, block->hdr.byte_count);
+	print_flags(block->hdr.block_code.flags, block->hdr.argument);
+}
 
-		while (current)
-		{
-			if (hdr.block_code.flags & ~BFLAG_FILL)
-				goto not_a_match; /* skip check if any bit other than BFLAG_FILL is set; we'll just arrive at the end of the linked list */
+/*
+With --cache-dir, the output image is kept in the cache directory under a SHA-256 digest of everything that it depends on: the input file,
+the options (and the entry address), the contents of the files that they name, and the build of ldrshrink itself.  When the same
+hash comes up again, the cached image is copied to the output without parsing anything.  The output and the cache entry are always
+separate files, so that nothing that later rewrites the output in place can change what the cache holds.  Runs that produce anything
+more than the output image bypass the cache.
+*/
 
-			if ( (hdr.block_code.flags & BFLAG_FILL) && (hdr.byte_count > CUSTOMIZE_SMALLEST_FILL_BLOCK) )
-				goto not_a_match; /* this FILL block is too large to justify unrolling; we'll just arrive at the end of the linked list  */
+static int cache_usable(void)
+{
+	if (options.stage2_file || options.host_table_file || options.export_memory_prefix || options.trace_file || options.timeline_file)
+		return 0;
+	if (options.report || options.elf_file || options.advise || options.capture_file || options.pareto)
+		return 0;
 
-			if (current->flags & BFLAG_FILL)
-				goto not_a_match; /* segregate: do not join to existing FILL blocks */
+	return 1;
+}
 
-			if ( ( hdr.target_address >= current->address ) && ( hdr.target_address <= (current->address + current->length)) )
-			{
-				/* this block is contiguous with an already seen block */
-				additional = current;
-				break;
-			}
+static void cache_path(char *path, unsigned size, const unsigned char *input, unsigned input_length, char **args, int arg_count, const char *entry)
+{
+	const char *const files[] = { options.fill_stub_file, options.profile_file, options.fast_loader_file, options.memory_map_file, options.reference_file };
+	static const char build[] = __DATE__ " " __TIME__;
+	struct sha256_type context;
+	unsigned char digest[32], *data;
+	unsigned index, length;
+	int arg;
 
-not_a_match:
-			previous = current;
-			current = current->next;
-		}
+	/* a collision would hand back another image without a word, so the key is a cryptographic digest */
+	sha256_init(&context);
+	sha256_update(&context, build, sizeof(build));
+	sha256_update(&context, &input_length, sizeof(input_length));
+	sha256_update(&context, input, input_length);
 
-		/* determine whether we need to add an additional entry */
+	/* the options, less those that make no difference to the output, and the entry address; the terminating NULs keep them apart */
+	for (arg = 0; arg < arg_count; arg++)
+	{
+		if (!strncmp(args[arg], "--cache-dir=", 12) || !strncmp(args[arg], "--quiet", 7) || !strncmp(args[arg], "--verbose", 9))
+			continue;
 
-		if (!additional)
-		{
-			/* an additional entry is needed, so we create it and add it to the list */
+		sha256_update(&context, args[arg], strlen(args[arg]) + 1);
+	}
 
-			additional = (struct chunk_list_type *)malloc(sizeof(struct chunk_list_type));
-			memset(additional, 0, sizeof(struct chunk_list_type));
-			additional->address = hdr.target_address;
-			additional->argument = hdr.argument;
-			additional->flags = hdr.block_code.flags;
+	if (entry)
+		sha256_update(&context, entry, strlen(entry) + 1);
 
-			if (previous)
-				previous->next = additional;
-			else
-				list = additional;
+	for (arg = 0; arg < (int)(sizeof(files) / sizeof(files[0])); arg++)
+	{
+		if (!files[arg])
+			continue;
 
-			additional->next = current;
-			output_block_count++;
-		}
+		data = load_file(files[arg], &length);
+		if (NULL == data)
+			continue;
 
-		/* compute how many bytes are being added to this entry (whether the entry is additional or existing) */
+		sha256_update(&context, &length, sizeof(length));
+		sha256_update(&context, data, length);
 
-		if ( (hdr.target_address + hdr.byte_count) > (additional->address + additional->length) )
-		{
-			additional_bytes = (hdr.target_address + hdr.byte_count) - (additional->address + additional->length);
+		free(data);
+	}
 
-			if (hdr.block_code.flags & BFLAG_FILL)
-			{
-				/* this is a Fill Block... we append if and only if the current Block isn't also a Fill Block */
-				if (!(additional->flags & BFLAG_FILL))
-				{
-					additional->data = realloc(additional->data, additional->length + additional_bytes);
-					ptr = additional->data + (hdr.target_address - additional->address);
-					while (hdr.byte_count >= sizeof(hdr.argument))
-					{
-						memcpy(ptr, &hdr.argument, sizeof(hdr.argument));
-						ptr += sizeof(hdr.argument);
-						hdr.byte_count -= sizeof(hdr.argument);
-					}
-				}
-			}
-			else
-			{
-				/* this is not a Fill Block, so we read in the data */
-				additional->data = realloc(additional->data, additional->length + additional_bytes);
-				fread(additional->data + (hdr.target_address - additional->address), 1, hdr.byte_count, input);
-			}
+	sha256_final(&context, digest);
 
-			/* update the entry length to reflect the added data */
-			additional->length += additional_bytes;
-		}
-		else
-		{
-			if (hdr.byte_count)
-				fprintf(stderr, "WARNING: memory overwrite in region 0x%x to 0x%x\n", hdr.target_address, hdr.target_address + hdr.byte_count);
-		}
+	length = snprintf(path, size, "%s/", options.cache_dir);
+	for (index = 0; (index < sizeof(digest)) && (length + 2 < size); index++)
+		length += snprintf(path + length, size - length, "%02x", digest[index]);
+	snprintf(path + length, size - length, ".ldr");
+}
+
+/* create the directory, and any of its parents, unless it already exists */
+static int make_directory(const char *path)
+{
+	char partial[1024];
+	unsigned length;
 
-		if (hdr.block_code.flags & BFLAG_INIT)
+	for (length = 0; path[length] && (length + 1 < sizeof(partial)); length++)
+	{
+		partial[length] = path[length];
+
+		if ( length && (('/' == path[length + 1]) || ('\\' == path[length + 1]) || !path[length + 1]) )
 		{
-			if (list)
-			{
-				write_image(output, list, &settings);
-				list = NULL;
-			}
+			partial[length + 1] = '\0';
+			if (mkdir(partial, 0777) && (EEXIST != errno))
+				return -1;
 		}
 	}
 
-	fclose(input);
-
-	/* finish the output file with the Final Block */
+	return 0;
+}
 
-	hdr.block_code.flags = BFLAG_FINAL;
-	hdr.target_address = settings.entry_point;
-	hdr.argument = 0;
-	hdr.byte_count = 0;
+/*
+SHA-256 (FIPS 180-4)
+*/
 
-	write_header(output, &hdr);
+static const unsigned sha256_constants[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
 
-	fclose(output);
+#define SHA256_ROTATE(x, n) ( ((x) >> (n)) | ((x) << (32 - (n))) )
 
-	/* provide some metrics on how much the loader image has been simplified */
-	printf("---\n%d blocks read; %d blocks written\n", input_block_count, output_block_count);
+static void sha256_init(struct sha256_type *context)
+{
+	static const unsigned initial[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
 
-	return 0;
+	memcpy(context->state, initial, sizeof(initial));
+	context->length = 0;
+	context->used = 0;
 }
 
-static void write_header(FILE *handle, struct block_header_type *hdr)
+static void sha256_update(struct sha256_type *context, const void *data, unsigned long long length)
 {
-	/* set checksum to zero so that... */
-	hdr->block_code.hdrchk = 0;
-	/* ...the calculated result will be the correct checksum */
-	hdr->block_code.hdrchk = calc_header_checksum(hdr);
+	const unsigned char *bytes;
+	unsigned count;
 
-	fwrite(hdr, sizeof(struct block_header_type), 1, handle);
+	bytes = (const unsigned char *)data;
+	context->length += length;
+
+	while (length)
+	{
+		count = 64 - context->used;
+		if (count > length)
+			count = (unsigned)length;
+
+		memcpy(context->block + context->used, bytes, count);
+		context->used += count;
+		bytes += count;
+		length -= count;
+
+		if (64 == context->used)
+		{
+			sha256_block(context, context->block);
+			context->used = 0;
+		}
+	}
 }
 
-static unsigned char calc_header_checksum(struct block_header_type *hdr)
+static void sha256_final(struct sha256_type *context, unsigned char *digest)
 {
-	unsigned char checksum;
+	unsigned long long bits;
 	unsigned index;
 
-	/* checksum is an XOR of all bytes in the header */
-	checksum = 0;
-	for (index = 0; index < sizeof(struct block_header_type); index++)
-		checksum ^= *((unsigned char *)hdr + index);
+	bits = context->length * 8;
 
-	return checksum;
+	context->block[context->used++] = 0x80;
+	if (context->used > 56)
+	{
+		memset(context->block + context->used, 0, 64 - context->used);
+		sha256_block(context, context->block);
+		context->used = 0;
+	}
+	memset(context->block + context->used, 0, 56 - context->used);
+
+	for (index = 0; index < 8; index++)
+		context->block[56 + index] = (unsigned char)(bits >> (56 - 8 * index));
+	sha256_block(context, context->block);
+
+	for (index = 0; index < 32; index++)
+		digest[index] = (unsigned char)(context->state[index / 4] >> (24 - 8 * (index % 4)));
 }
 
-static void write_image(FILE *handle, struct chunk_list_type *list, struct image_settings_type *settings)
+static void sha256_block(struct sha256_type *context, const unsigned char *block)
 {
-	struct chunk_list_type *current, *previous;
-	unsigned position;
-	struct block_header_type hdr;
+	unsigned w[64], v[8], index, s0, s1, t1, t2;
 
-	/*
-	for diagnostic purposes, we print out what we've simplified the loader data into
-	*/
+	for (index = 0; index < 16; index++)
+		w[index] = ((unsigned)block[4 * index] << 24) | ((unsigned)block[4 * index + 1] << 16) | ((unsigned)block[4 * index + 2] << 8) | block[4 * index + 3];
 
-	printf("--- write 0x%02x entry 0x%x\n", settings->hdrsign, settings->entry_point);
+	for (; index < 64; index++)
+	{
+		s0 = SHA256_ROTATE(w[index - 15], 7) ^ SHA256_ROTATE(w[index - 15], 18) ^ (w[index - 15] >> 3);
+		s1 = SHA256_ROTATE(w[index - 2], 17) ^ SHA256_ROTATE(w[index - 2], 19) ^ (w[index - 2] >> 10);
+		w[index] = w[index - 16] + s0 + w[index - 7] + s1;
+	}
 
-	current = list;
-	position = sizeof(struct block_header_type);
+	memcpy(v, context->state, sizeof(v));
 
-	while (current)
+	for (index = 0; index < 64; index++)
 	{
-		printf("0x%x 0x%x", current->address, current->length);
-		print_flags(current->flags, current->argument);
-
-		position += sizeof(struct block_header_type);
-		if (current->data)
-			position += current->length;
+		s1 = SHA256_ROTATE(v[4], 6) ^ SHA256_ROTATE(v[4], 11) ^ SHA256_ROTATE(v[4], 25);
+		t1 = v[7] + s1 + ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_constants[index] + w[index];
+		s0 = SHA256_ROTATE(v[0], 2) ^ SHA256_ROTATE(v[0], 13) ^ SHA256_ROTATE(v[0], 22);
+		t2 = s0 + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
 
-		current = current->next;
+		v[7] = v[6];
+		v[6] = v[5];
+		v[5] = v[4];
+		v[4] = v[3] + t1;
+		v[3] = v[2];
+		v[2] = v[1];
+		v[1] = v[0];
+		v[0] = t1 + t2;
 	}
 
-	/*
-	now we write out the new, simplfied loader image
-	*/
-
-	memset(&hdr, 0, sizeof(struct block_header_type));
+	for (index = 0; index < 8; index++)
+		context->state[index] += v[index];
+}
 
-	hdr.block_code.bcode = settings->bcode;
-	hdr.block_code.flags = BFLAG_IGNORE | BFLAG_FIRST;
-	hdr.block_code.hdrsign = settings->hdrsign;
-	hdr.target_address = settings->entry_point;
-	hdr.argument = position;
-	
-	write_header(handle, &hdr);
+static int cache_fetch(const char *path, const char *output_name)
+{
+	FILE *handle;
 
-	current = list;
-	previous = NULL;
+	handle = fopen(path, "rb");
+	if (NULL == handle)
+		return -1;
+	fclose(handle);
 
-	while (current)
-	{
-		hdr.block_code.flags = current->flags;
-		hdr.argument = current->argument;
-		hdr.byte_count = current->length;
-		hdr.target_address = current->address;
+	return copy_file(path, output_name);
+}
 
-		write_header(handle, &hdr);
+static void cache_store(const char *output_name, const char *path)
+{
+	char temporary[1040];
 
-		if (current->data)
-		{
-			/* this is not a Fill Block, so write out the data */
-			fwrite(current->data, 1, current->length, handle);
-			free(current->data);
-		}
+	/* written under a temporary name first, so that a concurrent run never sees half a file */
+	snprintf(temporary, sizeof(temporary), "%s.%u.tmp", path, (unsigned)getpid());
 
-		previous = current;
-		current = current->next;
-		free(previous);
+	if (copy_file(output_name, temporary) || rename(temporary, path))
+	{
+		remove(temporary);
+		fprintf(stderr, "WARNING: unable to store the output in the cache\n");
 	}
 }
 
-static void print_flags(unsigned flags, unsigned argument)
+static int copy_file(const char *from, const char *to)
 {
-	if (flags & BFLAG_FILL)
-		printf(" FILL (0x%x)", argument);
-	if (flags & BFLAG_INIT)
-		printf(" INIT");
-	printf("\n");
+	unsigned char *data;
+	unsigned length;
+	FILE *handle;
+	int result;
+
+	data = load_file(from, &length);
+	if (NULL == data)
+		return -1;
+
+	handle = fopen(to, "wb");
+	if (NULL == handle)
+	{
+		free(data);
+		return -1;
+	}
+
+	result = (fwrite(data, 1, length, handle) == length) ? 0 : -1;
+	if (fclose(handle))
+		result = -1;
+	free(data);
+
+	return result;
 }
@@ -0,0 +1,41 @@
+/* basic.ldr, with decimal elements */
+const unsigned char ldr_image[] =
+{
+	1, 80, 158, 173, 0, 0, 0, 32, 0, 0, 0, 0, 64, 2, 0, 0,
+	1, 0, 204, 173, 0, 0, 0, 32, 64, 0, 0, 0, 0, 0, 0, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+	32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+	48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63,
+	1, 0, 140, 173, 64, 0, 0, 32, 64, 0, 0, 0, 0, 0, 0, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+	32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+	48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63,
+	1, 1, 77, 173, 128, 0, 0, 32, 64, 0, 0, 0, 0, 0, 0, 0,
+	1, 0, 108, 173, 192, 0, 0, 32, 32, 0, 0, 0, 0, 0, 0, 0,
+	17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+	17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+	1, 0, 188, 173, 0, 16, 0, 32, 32, 0, 0, 0, 0, 0, 0, 0,
+	34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34,
+	34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34,
+	1, 1, 181, 173, 0, 32, 0, 32, 0, 16, 0, 0, 120, 86, 52, 18,
+	1, 1, 201, 173, 0, 64, 0, 32, 0, 4, 0, 0, 0, 0, 0, 0,
+	1, 1, 217, 173, 0, 80, 0, 32, 0, 4, 0, 0, 0, 0, 0, 0,
+	1, 1, 233, 173, 0, 96, 0, 32, 0, 4, 0, 0, 0, 0, 0, 0,
+	1, 1, 249, 173, 0, 112, 0, 32, 0, 4, 0, 0, 0, 0, 0, 0,
+	1, 8, 20, 173, 0, 128, 0, 32, 16, 0, 0, 0, 0, 0, 0, 0,
+	51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
+	1, 0, 157, 173, 0, 1, 0, 32, 16, 0, 0, 0, 0, 0, 0, 0,
+	68, 68, 68, 68, 68, 68, 68, 68, 68, 68, 68, 68, 68, 68, 68, 68,
+	1, 0, 76, 173, 224, 0, 0, 32, 32, 0, 0, 0, 0, 0, 0, 0,
+	85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85,
+	85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85, 85,
+	1, 0, 12, 173, 0, 0, 0, 128, 32, 0, 0, 0, 0, 0, 0, 0,
+	102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102,
+	102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102,
+	1, 0, 44, 173, 32, 0, 0, 128, 32, 0, 0, 0, 0, 0, 0, 0,
+	102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102,
+	102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102, 102,
+	1, 128, 12, 173, 0, 0, 0, 32, 0, 0, 0, 0, 0, 0, 0, 0,
+};
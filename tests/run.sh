@@ -0,0 +1,50 @@
+#!/bin/sh
+# regression tests: ./tests/run.sh <ldrshrink binary>
+
+tool=${1:-./ldrshrink}
+dir=$(dirname "$0")
+out=${TMPDIR:-/tmp}/ldrshrink-test.$$
+failed=0
+
+# a hang is a failure too, so use timeout(1) where there is one
+limit=
+if command -v timeout >/dev/null 2>&1; then
+	limit="timeout 10"
+fi
+
+expect()
+{
+	want=$1
+	shift
+	$limit "$tool" --quiet "$@" >/dev/null 2>&1
+	got=$?
+	if [ "$want" = fail ] && [ $got -ne 0 ] && [ $got -ne 124 ]; then
+		return
+	fi
+	if [ "$want" = pass ] && [ $got -eq 0 ]; then
+		return
+	fi
+	echo "FAILED ($want, exit status $got): $*"
+	failed=1
+}
+
+# an Ignore Block whose byte count wraps the stream position, and one that runs past the end
+expect fail "$dir/ignore-wrap.ldr" "$out"
+expect fail "$dir/ignore-truncated.ldr" "$out"
+expect pass --diff "$dir/ignore-wrap.ldr" "$dir/ignore-truncated.ldr"
+
+# a C array's unprefixed numbers are decimal, and without a declared element type they have no width
+expect pass "$dir/decimal.h" "$out"
+expect pass "$dir/hex.h" "$out.hex"
+if ! cmp -s "$out" "$out.hex"; then
+	echo "FAILED: decimal.h and hex.h decode differently"
+	failed=1
+fi
+expect fail "$dir/undeclared.h" "$out"
+
+rm -f "$out" "$out.hex"
+
+if [ $failed -eq 0 ]; then
+	echo "all tests passed"
+fi
+exit $failed